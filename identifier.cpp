@@ -4,22 +4,155 @@
 * Senior Project
 */
 
+#include "identifier.h"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <iostream>
 #include <cmath>
+#include <cfloat>
 #include <string>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <shared_mutex>
+#include <fstream>
+#include <chrono>
+#include <bitset>
+#include <cstdint>
+#include <sys/stat.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IDENTIFIER_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are always compiled and only called when the CPU supports them
+#if defined(IDENTIFIER_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define IDENTIFIER_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define IDENTIFIER_TARGET_AVX2
+#else
+#define IDENTIFIER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// AVX-512 popcount kernels need a compiler that knows VPOPCNTDQ
+#if defined(IDENTIFIER_AVX2) && ((defined(_MSC_VER) && _MSC_VER >= 1920) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8))
+#define IDENTIFIER_AVX512
+#ifdef _MSC_VER
+#define IDENTIFIER_TARGET_AVX512
+#else
+#define IDENTIFIER_TARGET_AVX512 __attribute__((target("avx512f,avx512vpopcntdq")))
+#endif
+#endif
+
 using namespace cv;
 using namespace std;
 
+/*
+	PACKMASK - Packs a mask into one bit per set pixel
+	   Bit i of the result is pixel i counted row by row. The words are padded
+	   with zeros to whole 64 byte lines so compare kernels need no tail.
+	   Return - 1 row CV_8U Mat holding the 64 bit words
+*/
+Mat packMask(const Mat &shape)
+{
+	int pixels = shape.rows * shape.cols;
+	int words = (pixels + 511) / 512 * 8;
+	Mat bits = Mat::zeros(1, words * 8, CV_8U);
+	uint64_t *out = bits.ptr<uint64_t>();
+	int i = 0;
+
+#ifdef IDENTIFIER_SSE2
+	if (shape.isContinuous())
+	{
+		// 16 pixels at a time become 16 bits of the output
+		const uchar *src = shape.ptr<uchar>();
+		const __m128i zero = _mm_setzero_si128();
+		for (; i <= pixels - 16; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			unsigned short set = (unsigned short)~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+			out[i >> 6] |= (uint64_t)set << (i & 63);
+		}
+	}
+#endif
+	for (; i < pixels; i++)
+	{
+		if (shape.at<uchar>(i / shape.cols, i % shape.cols))
+			out[i >> 6] |= (uint64_t)1 << (i & 63);
+	}
+	return bits;
+}
+
+// Number of values in a shape descriptor
+const int DESCRIPTOR_SIZE = 8;
+
+/*
+	DESCRIBESHAPE - Summarizes a mask in a few numbers of about the same range
+	   Masks that differ in few pixels have close descriptors, so the closest
+	   descriptors give the items worth comparing pixel by pixel.
+	   Inputs - mask of the shape, the DESCRIPTOR_SIZE values to fill
+*/
+void describeShape(const Mat &shape, float *descriptor)
+{
+	Moments m = moments(shape, true);
+	double hu[7];
+	HuMoments(m, hu);
+	Rect box = boundingRect(shape);
+
+	for (int i = 0; i < DESCRIPTOR_SIZE; i++)
+		descriptor[i] = 0;
+	if (m.m00 == 0)
+		return;
+
+	// size and position, as fractions of the image
+	descriptor[0] = (float)sqrt(m.m00 / shape.total());
+	descriptor[1] = (float)box.width / shape.cols;
+	descriptor[2] = (float)box.height / shape.rows;
+	descriptor[3] = (float)(m.m10 / m.m00 / shape.cols);
+	descriptor[4] = (float)(m.m01 / m.m00 / shape.rows);
+
+	// form, from the first Hu moments on a log scale
+	for (int i = 0; i < 3; i++)
+	{
+		double magnitude = fabs(hu[i]) > 1e-30 ? -log10(fabs(hu[i])) : 30;
+		descriptor[5 + i] = (float)(magnitude / 10);
+	}
+}
+
+// Color histogram of an item: hue in 15 degree steps, each split by saturation
+const int HUE_BINS = 12;
+const int SAT_BINS = 4;
+const int COLOR_BINS = HUE_BINS * SAT_BINS;
 
 class Item
 {
 public:
-	Mat shape;
+	Mat shape;			// full mask, kept only while the item is being identified
+	Mat bits;			// the mask packed by packMask
+	Size maskSize;
+	float descriptor[DESCRIPTOR_SIZE];	// made by describeShape
+	float colors[COLOR_BINS];			// share of the pixels in each color bin, sums to 1
 	string name;
 	string firstColor;
 	string secondColor;
@@ -30,6 +163,15 @@ public:
 	Item(Mat pShape, string pFirstColor, string pSecondColor, string pThirdColor, int pNonZeros)
 	{
 		shape = pShape;
+		maskSize = pShape.size();
+		if (!pShape.empty())
+		{
+			bits = packMask(pShape);
+			describeShape(pShape, descriptor);
+		}
+		else
+			fill(descriptor, descriptor + DESCRIPTOR_SIZE, 0.0f);
+		fill(colors, colors + COLOR_BINS, 0.0f);
 		firstColor = pFirstColor;
 		secondColor = pSecondColor;
 		thirdColor = pThirdColor;
@@ -49,1011 +191,3616 @@ public:
 };
 
 /*
-	GRAYSCALEIMAGE - Turns the orignal colored image into a grayscale image
-       Inputs - Colored image with RGB values in each pixel
-	   Return - Image in grayscale (CV_8U Type) 
+	THREADPOOL - Fixed set of worker threads that image stages hand jobs to
+	   parallelFor runs on the workers and on the calling thread, so a pool
+	   with no workers simply runs everything on the caller.
 */
-Mat toGrayscale(Mat &colorImage)
+class ThreadPool
 {
-    Mat grayImage = Mat::zeros(colorImage.size(), CV_8U);
+public:
+	ThreadPool(int workerCount)
+	{
+		stopping = false;
+		for (int i = 0; i < workerCount; i++)
+			workers.push_back(thread(&ThreadPool::workerLoop, this));
+	}
 
-	// visit every pixel in image
-	for (int y = 0;y<colorImage.rows;y++)
+	~ThreadPool()
 	{
-		for (int x = 0;x<colorImage.cols;x++)
 		{
-			//extract pixel color data
-			Vec3b intensity = colorImage.at<Vec3b>(y, x);
-			int b = intensity.val[0];  //blue value of pixel
-			int g = intensity.val[1];  //green value of pixel
-			int r = intensity.val[2];  // red value of pixel
-
-			// Formula to convert RGB values to grayscale intensity
-			double gray = (0.1140 * b) + (0.5870 * g) + (0.2989 * r);
-
-			// set corresponding pixel in grayscale image
-			grayImage.at<uchar>(y, x) = gray;
+			lock_guard<mutex> lock(queueMutex);
+			stopping = true;
 		}
+		queueReady.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
 	}
 
-	return grayImage;
-}
-
-void insertionSort(int window[])
-{
-	int temp, i, j;
-	for (i = 0; i < 9; i++) {
-		temp = window[i];
-		for (j = i - 1; j >= 0 && temp < window[j]; j--) {
-			window[j + 1] = window[j];
-		}
-		window[j + 1] = temp;
+	// Number of threads that share the work of a parallelFor
+	int size() const
+	{
+		return (int)workers.size() + 1;
 	}
-}
 
-void medianFilter(Mat src, Mat dst)
-{
-	//create a sliding window of size 9
-	int window[9];
-    
-	//mark all pixels in dst image as black
-	for (int y = 0; y < src.rows; y++)
-		for (int x = 0; x < src.cols; x++)
-			dst.at<uchar>(y, x) = 0.0;
- 
-	for (int y = 1; y < src.rows - 1; y++)
+	// Runs job(i) for every i in [0, count), returns when all of them are done
+	void parallelFor(int count, const function<void(int)> &job)
 	{
-		for (int x = 1; x < src.cols - 1; x++) 
+		if (count <= 0)
+			return;
+
+		int helpers = min(count, size()) - 1;
+		shared_ptr<Batch> batch = make_shared<Batch>(count, helpers + 1, job);
 		{
+			lock_guard<mutex> lock(queueMutex);
+			for (int i = 0; i < helpers; i++)
+				jobs.push_back(batch);
+		}
+		for (int i = 0; i < helpers; i++)
+			queueReady.notify_one();
+
+		// the caller takes jobs too, so nested calls from a worker cannot stall
+		batch->run();
 
-			// Pick up window element
+		unique_lock<mutex> lock(batch->doneMutex);
+		while (batch->done < count)
+			batch->allDone.wait(lock);
+	}
 
-			window[0] = src.at<uchar>(y - 1, x - 1);
-			window[1] = src.at<uchar>(y, x - 1);
-			window[2] = src.at<uchar>(y + 1, x - 1);
-			window[3] = src.at<uchar>(y - 1, x);
-			window[4] = src.at<uchar>(y, x);
-			window[5] = src.at<uchar>(y + 1, x);
-			window[6] = src.at<uchar>(y - 1, x + 1);
-			window[7] = src.at<uchar>(y, x + 1);
-			window[8] = src.at<uchar>(y + 1, x + 1);
+private:
+	// Jobs of one parallelFor. Every thread that joins starts on its own
+	// share of the indexes, taken from the front. A thread that runs out
+	// steals the back half of what another has left, so neighbouring
+	// indexes mostly stay on one thread and nobody waits on a thread that
+	// joined late or got slow jobs.
+	class Batch
+	{
+	public:
+		int count;
+		const function<void(int)> &job;
+		vector<atomic<uint64_t> > ranges;	// [begin, end) of each share, begin in the high half
+		atomic<int> joined;
+		int done;
+		mutex doneMutex;
+		condition_variable allDone;
+
+		Batch(int pCount, int shares, const function<void(int)> &pJob) : job(pJob), ranges(shares), joined(0)
+		{
+			count = pCount;
+			done = 0;
+			for (int i = 0; i < shares; i++)
+				ranges[i] = pack((int)((long long)count * i / shares), (int)((long long)count * (i + 1) / shares));
+		}
 
-			// sort the window to find median
-			insertionSort(window);
+		void run()
+		{
+			int own = joined++;
+			int ran = 0;
+			int i;
+			while (true)
+			{
+				if (take(own, i))
+				{
+					job(i);
+					ran++;
+				}
+				else if (!steal(own))
+					break;
+			}
+			if (ran == 0)
+				return;
 
-			// assign the median to centered element of the matrix
-			dst.at<uchar>(y, x) = window[4];
+			lock_guard<mutex> lock(doneMutex);
+			done += ran;
+			if (done == count)
+				allDone.notify_all();
 		}
-	}
-	
-}
 
-// Computes the x component of the gradient vector
-// at a given point in a image.
-// returns gradient in the x direction
-int xGradient(Mat image, int x, int y)
-{
-	return image.at<uchar>(y - 1, x - 1) +
-		2 * image.at<uchar>(y, x - 1) +
-		image.at<uchar>(y + 1, x - 1) -
-		image.at<uchar>(y - 1, x + 1) -
-		2 * image.at<uchar>(y, x + 1) -
-		image.at<uchar>(y + 1, x + 1);
-}
+		// Takes the first index left in a share
+		bool take(int share, int &index)
+		{
+			uint64_t range = ranges[share].load();
+			while (begin(range) < end(range))
+			{
+				if (ranges[share].compare_exchange_weak(range, pack(begin(range) + 1, end(range))))
+				{
+					index = begin(range);
+					return true;
+				}
+			}
+			return false;
+		}
 
-// Computes the y component of the gradient vector
-// at a given point in a image
-// returns gradient in the y direction
+		// Moves the back half of the next share with indexes left into an empty share.
+		// A share only ever loses its first index to its owner, so it never
+		// goes back to a value another thread may still be comparing against.
+		bool steal(int own)
+		{
+			int shares = (int)ranges.size();
+			for (int k = 1; k < shares; k++)
+			{
+				int victim = (own + k) % shares;
+				uint64_t range = ranges[victim].load();
+				while (begin(range) < end(range))
+				{
+					int middle = begin(range) + (end(range) - begin(range)) / 2;
+					if (ranges[victim].compare_exchange_weak(range, pack(begin(range), middle)))
+					{
+						ranges[own] = pack(middle, end(range));
+						return true;
+					}
+				}
+			}
+			return false;
+		}
 
-int yGradient(Mat image, int x, int y)
-{
-	return image.at<uchar>(y - 1, x - 1) +
-		2 * image.at<uchar>(y - 1, x) +
-		image.at<uchar>(y - 1, x + 1) -
-		image.at<uchar>(y + 1, x - 1) -
-		2 * image.at<uchar>(y + 1, x) -
-		image.at<uchar>(y + 1, x + 1);
-}
+	private:
+		static uint64_t pack(int first, int last)
+		{
+			return ((uint64_t)(uint32_t)first << 32) | (uint32_t)last;
+		}
 
-void sobrelFilter(Mat src, Mat mag, Mat angle)
-{
-	double gx, gy, sum;
+		static int begin(uint64_t range)
+		{
+			return (int)(range >> 32);
+		}
 
-	for (int y = 0; y < src.rows; y++)
-		for (int x = 0; x < src.cols; x++)
-			mag.at<uchar>(y, x) = 0.0;
+		static int end(uint64_t range)
+		{
+			return (int)(uint32_t)range;
+		}
+	};
 
-	for (int y = 1; y < src.rows - 1; y++) 
+	void workerLoop()
 	{
-		for (int x = 1; x < src.cols - 1; x++) 
+		while (true)
 		{
-			gx = xGradient(src, x, y);
-			gy = yGradient(src, x, y);
-			sum = abs(gx) + abs(gy);
-			sum = sum > 255 ? 255 : sum;
-			sum = sum < 0 ? 0 : sum;
-			mag.at<uchar>(y, x) = sum;
-	
-			double theta = (atan2(gy, gx) * 180)/ 3.14; 
-			/* Convert actual edge direction to approximate value */
-			if (((theta < 22.5) && (theta > -22.5)) || (theta > 157.5) || (theta < -157.5))
-				angle.at<uchar>(y, x)  = 0;
-			if (((theta > 22.5) && (theta < 67.5)) || ((theta < -112.5) && (theta > -157.5)))
-				angle.at<uchar>(y, x)  = 45;
-			if (((theta > 67.5) && (theta < 112.5)) || ((theta < -67.5) && (theta > -112.5)))
-				angle.at<uchar>(y, x)  = 90;
-			if (((theta > 112.5) && (theta < 157.5)) || ((theta < -22.5) && (theta > -67.5)))
-				angle.at<uchar>(y, x)  = 135; 
+			shared_ptr<Batch> batch;
+			{
+				unique_lock<mutex> lock(queueMutex);
+				while (!stopping && jobs.empty())
+					queueReady.wait(lock);
+				if (jobs.empty())
+					return;
+				batch = jobs.front();
+				jobs.pop_front();
+			}
+			batch->run();
 		}
 	}
-}
 
-void findEdge(Mat edges, Mat mag, Mat angle, int rowShift, int colShift, int row, int col, int dir, int lowerThreshold)
-{
-	int W = mag.cols;
-	int H = mag.rows;
-	int newRow;
-	int newCol;
-	bool edgeEnd = false;
+	vector<thread> workers;
+	deque<shared_ptr<Batch> > jobs;
+	mutex queueMutex;
+	condition_variable queueReady;
+	bool stopping;
+};
 
-	/* Find the row and column values for the next possible pixel on the edge */
-	if (colShift < 0) 
-	{
-		if (col > 0)
-			newCol = col + colShift;
-		else
-			edgeEnd = true;
-	}
-	else if (col < W - 1) 
-	{
-		newCol = col + colShift;
-	}
-	else
-		edgeEnd = true;		// If the next pixel would be off image, don't do the while loop
-	
-	if (rowShift < 0) 
-	{
-		if (row > 0)
-			newRow = row + rowShift;
-		else
-			edgeEnd = true;
-	}
-	else if (row < H - 1) 
+/*
+	PIPELINEOPTIONS - Settings that control how imageProcessing runs its stages
+*/
+class PipelineOptions
+{
+public:
+	bool fused;			// run grayscale, median and sobrel filter as one streaming pass
+	int medianRadius;	// median window is (2 * medianRadius + 1) pixels square
+	bool legacyEdges;	// trace and thin edges with the original straight line walks
+	ThreadPool *pool;	// threads for the parallel stages, 0 runs them on the caller
+	bool showWindows;	// show the images of each stage, off for unattended runs
+	double outlineTolerance;	// pixels the object outline may cut corners by, 0 keeps every boundary pixel
+	int pyramidScale;	// find the object on a frame this many times smaller (4 or 8) and filter only around it, 1 filters the whole frame
+
+	PipelineOptions()
 	{
-		newRow = row + rowShift;
+		fused = true;
+		medianRadius = 1;
+		legacyEdges = false;
+		pool = 0;
+		showWindows = true;
+		outlineTolerance = 1.0;
+		pyramidScale = 1;
 	}
-	else
-		edgeEnd = true;
+};
 
-	/* Determine edge directions and gradient strengths */
-	while (!edgeEnd && (mag.at<uchar>(newRow, newCol) > lowerThreshold) && (angle.at<uchar>(newRow, newCol) == dir)) 
+/*
+	PIPELINEWORKSPACE - Frame buffers that imageProcessing reuses from frame to frame
+	   The buffers are only allocated, and zeroed once, when the frame size
+	   changes. Every stage writes all the pixels that later stages read, so
+	   no buffer has to be cleared between frames. The shape of the returned
+	   Item points into the workspace and is overwritten by the next frame.
+	   When only part of the frame is filtered, the edges and shape outside
+	   it keep their old values, so the part the last frame wrote is cleared.
+*/
+class PipelineWorkspace
+{
+public:
+	Mat gray;
+	Mat blur;
+	Mat mag;
+	Mat angle;
+	Mat edges;
+	Mat shape;
+	Rect written;		// edges and shape are zero outside this rectangle
+
+	// the frame shrunk to find the object on, and its filtered images
+	Mat small;
+	Mat smallMag;
+	Mat smallAngle;
+	Mat smallEdges;
+
+	// Makes every buffer the size of a frame, keeps them if they already are.
+	// The small buffers are made when scale is above 1, and the gray and
+	// blur buffers only when the stages run one at a time, since the fused
+	// pass never writes them.
+	void prepare(Size size, int scale = 1, bool separateStages = false)
 	{
-		edges.at<uchar>(newRow, newCol) = 255;
-
-		if (colShift < 0) 
+		if (!separateStages)
 		{
-			if (newCol > 0)
-				newCol = newCol + colShift;
-			else
-				edgeEnd = true;
+			gray.release();
+			blur.release();
 		}
-		else if (newCol < W - 1) 
+		else if (gray.size() != size)
 		{
-			newCol = newCol + colShift;
+			gray = Mat::zeros(size, CV_8U);
+			blur = Mat::zeros(size, CV_8U);
 		}
-		else
-			edgeEnd = true;
-		
-		if (rowShift < 0) 
+
+		if (mag.size() != size)
 		{
-			if (newRow > 0)
-				newRow = newRow + rowShift;
-			else
-				edgeEnd = true;
+			mag = Mat::zeros(size, CV_8U);
+			angle = Mat::zeros(size, CV_8U);
+			edges = Mat::zeros(size, CV_8U);
+			shape = Mat::zeros(size, CV_8U);
+			written = Rect();
 		}
-		else if (newRow < H - 1) 
+
+		Size smallSize(size.width / scale, size.height / scale);
+		if (scale > 1 && smallMag.size() != smallSize)
 		{
-			newRow = newRow + rowShift;
+			smallMag = Mat::zeros(smallSize, CV_8U);
+			smallAngle = Mat::zeros(smallSize, CV_8U);
+			smallEdges = Mat::zeros(smallSize, CV_8U);
 		}
-		else
-			edgeEnd = true;
 	}
-}
+};
 
-void traceEdge(Mat mag, Mat angle, Mat edges, int upperThreshold, int lowerThreshold)
+// Splits rows [top, bottom) into bands of at least minRows rows, a few per
+// thread so uneven bands even out. Returns the first row of every band
+// followed by bottom.
+vector<int> rowBands(ThreadPool *pool, int top, int bottom, int minRows)
 {
-	int H = mag.rows;
-	int W = mag.cols;
+	int rows = max(bottom - top, 0);
+	int bands = pool ? max(min(pool->size() * 4, rows / minRows), 1) : 1;
+	vector<int> bandTop(bands + 1);
 
-	/* Trace along all the edges in the image */
-	for (int y = 1; y < H - 1; y++)
-	{
-		for (int x = 1; x < W - 1; x++) 
-		{
-			bool edgeEnd = false;
-			if (mag.at<uchar>(y,x) > upperThreshold) 
-			{		
-				// Check to see if current pixel has a high enough gradient strength to be part of an edge
-				/* Switch based on current pixel's edge direction */
-				switch (angle.at<uchar>(y, x)) 
-				{			
-				case 0:
-					findEdge(edges, mag, angle, 0, 1, y, x, 0, lowerThreshold);
-					break;
-				case 45:
-					findEdge(edges, mag, angle, 1, 1, y, x, 45, lowerThreshold);
-					break;
-				case 90:
-					findEdge(edges, mag, angle, 1, 0, y, x, 90, lowerThreshold);
-					break;
-				case 135:
-					findEdge(edges, mag, angle, 1, -1, y, x, 135, lowerThreshold);
-					break;
-				default:
-					break;
-				}
-			}
-			
-		}
-	}
+	for (int i = 0; i <= bands; i++)
+		bandTop[i] = top + (int)((long long)rows * i / bands);
+	return bandTop;
 }
 
-void suppressNonMax(Mat edges, Mat angles,Mat mag, int rowShift, int colShift, int row, int col, int dir)//, int lowerThreshold)
+// Runs job(bandTop, bandBottom) for every band of rows [top, bottom) on the pool
+void parallelRows(ThreadPool *pool, int top, int bottom, int minRows, const function<void(int, int)> &job)
 {
-	int H = edges.rows;
-	int W = edges.cols;
-	int newRow = 0;
-	int newCol = 0;
-	unsigned long i;
-	bool edgeEnd = false;
-	float nonMax[416][3];			// Temporarily stores gradients and positions of pixels in parallel edges
-	int pixelCount = 0;					// Stores the number of pixels in parallel edges
-	int count;						// A for loop counter
-	int max[3];						// Maximum point in a wide edge
-
-	if (colShift < 0) 
-	{
-		if (col > 0)
-			newCol = col + colShift;
-		else
-			edgeEnd = true;
-	}
-	else if (col < W - 1) 
-	{
-		newCol = col + colShift;
-	}
+	vector<int> bandTop = rowBands(pool, top, bottom, minRows);
+	int bands = (int)bandTop.size() - 1;
+
+	if (bands == 1)
+		job(top, bottom);
 	else
-		edgeEnd = true;		
-	
-	if (rowShift < 0) 
+		pool->parallelFor(bands, [&](int band) { job(bandTop[band], bandTop[band + 1]); });
+}
+
+// Pipeline stages that are timed on every frame
+enum Stage { STAGE_LOCATE, STAGE_GRAYSCALE, STAGE_MEDIAN, STAGE_SOBREL, STAGE_FUSED, STAGE_TRACE, STAGE_SUPPRESS,
+	STAGE_CENTER, STAGE_OUTLINE, STAGE_COLORS, STAGE_COMPARE, STAGE_FRAME, STAGE_MOTION, STAGE_COUNT };
+const char *STAGE_NAMES[STAGE_COUNT] = { "locate", "grayscale", "median", "sobrel", "fused", "trace", "suppress",
+	"center", "outline", "colors", "compare", "frame", "motion" };
+
+// Amount of work done by the stages, summed over all frames
+enum Counter { COUNT_EDGE_PIXELS, COUNT_SUPPRESSED_PIXELS, COUNT_CONTOUR_POINTS, COUNT_ITEMS_COMPARED, COUNTER_COUNT };
+const char *COUNTER_NAMES[COUNTER_COUNT] = { "edge_pixels_traced", "pixels_suppressed", "contour_points", "items_compared" };
+
+/*
+	LATENCYHISTOGRAM - Lock free histogram of stage times in microseconds
+	   Buckets grow by a factor of 2^(1/4), so a percentile read back from it
+	   is at most 19% above the real value. Covers 1 us to about 4 minutes.
+*/
+class LatencyHistogram
+{
+public:
+	static const int BUCKETS = 112;
+	atomic<unsigned long long> buckets[BUCKETS];
+	atomic<unsigned long long> count;
+	atomic<unsigned long long> totalMicros;
+	atomic<unsigned long long> maxMicros;
+
+	LatencyHistogram()
 	{
-		if (row > 0)
-			newRow = row + rowShift;
-		else
-			edgeEnd = true;
+		for (int i = 0; i < BUCKETS; i++)
+			buckets[i] = 0;
+		count = 0;
+		totalMicros = 0;
+		maxMicros = 0;
 	}
-	else if (row < H - 1) 
+
+	void add(double micros)
 	{
-		newRow = row + rowShift;
+		int bucket = micros < 1 ? 0 : min((int)(log2(micros) * 4) + 1, BUCKETS - 1);
+		unsigned long long whole = (unsigned long long)micros;
+
+		buckets[bucket]++;
+		count++;
+		totalMicros += whole;
+		unsigned long long previous = maxMicros;
+		while (whole > previous && !maxMicros.compare_exchange_weak(previous, whole))
+			;
 	}
-	else
-		edgeEnd = true;
-	
-	/* Find non-maximum parallel edges tracing up */
-	while (!edgeEnd && (edges.at<uchar>(newRow,newCol) == 255) && (angles.at<uchar>(newRow, newCol) == dir))
+
+	// Upper edge of the bucket that holds the given fraction of the samples,
+	// never more than the slowest sample
+	double percentile(double fraction) const
 	{
-		if (colShift < 0) {
-			if (newCol > 0)
-				newCol = newCol + colShift;
-			else
-				edgeEnd = true;
-		}
-		else if (newCol < W - 1) {
-			newCol = newCol + colShift;
-		}
-		else
-			edgeEnd = true;
-		if (rowShift < 0) {
-			if (newRow > 0)
-				newRow = newRow + rowShift;
-			else
-				edgeEnd = true;
-		}
-		else if (newRow < H - 1) {
-			newRow = newRow + rowShift;
+		unsigned long long total = count;
+		unsigned long long seen = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			seen += buckets[i];
+			if (total > 0 && seen >= fraction * total)
+				return min(pow(2.0, i / 4.0), (double)maxMicros);
 		}
-		else
-			edgeEnd = true;
-		nonMax[pixelCount][0] = newRow;
-		nonMax[pixelCount][1] = newCol;
-		nonMax[pixelCount][2] = mag.at<uchar>(newRow,newCol);
-		pixelCount++;
-		i = (unsigned long)(newRow * 3 * W + 3 * newCol);
-	}
-
-	/* Find non-maximum parallel edges tracing down */
-	edgeEnd = false;
-	colShift *= -1;
-	rowShift *= -1;
-	if (colShift < 0) {
-		if (col > 0)
-			newCol = col + colShift;
-		else
-			edgeEnd = true;
+		return 0;
 	}
-	else if (col < W - 1) {
-		newCol = col + colShift;
-	}
-	else
-		edgeEnd = true;
-	if (rowShift < 0) {
-		if (row > 0)
-			newRow = row + rowShift;
-		else
-			edgeEnd = true;
+};
+
+/*
+	PIPELINESTATS - Always on stage timings and work counters of the pipeline
+	   Read with writeJson, either on request or when the program exits.
+*/
+class PipelineStats
+{
+public:
+	LatencyHistogram stages[STAGE_COUNT];
+	atomic<unsigned long long> counters[COUNTER_COUNT];
+
+	PipelineStats()
+	{
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			counters[i] = 0;
 	}
-	else if (row < H - 1) {
-		newRow = row + rowShift;
+
+	void count(Counter counter, unsigned long long amount)
+	{
+		counters[counter] += amount;
 	}
-	else
-		edgeEnd = true;
-	i = (unsigned long)(newRow * 3 * W + 3 * newCol);
-	while ((angles.at<uchar>(newRow, newCol) == dir) && !edgeEnd && (edges.at<uchar>(newRow, newCol) == 255)) 
+
+	void writeJson(ostream &out)
 	{
-		if (colShift < 0) 
-		{
-			if (newCol > 0)
-				newCol = newCol + colShift;
-			else
-				edgeEnd = true;
-		}
-		else if (newCol < W - 1) 
-		{
-			newCol = newCol + colShift;
-		}
-		else
-			edgeEnd = true;
-		
-		if (rowShift < 0) 
+		unsigned long long frames = stages[STAGE_FRAME].count;
+
+		out << "{\n  \"frames\": " << frames << ",\n  \"stages\": {";
+		for (int i = 0; i < STAGE_COUNT; i++)
 		{
-			if (newRow > 0)
-				newRow = newRow + rowShift;
-			else
-				edgeEnd = true;
+			const LatencyHistogram &stage = stages[i];
+			unsigned long long runs = stage.count;
+			out << (i ? "," : "") << "\n    \"" << STAGE_NAMES[i] << "\": { \"count\": " << runs
+				<< ", \"mean_us\": " << (runs ? (double)stage.totalMicros / runs : 0.0)
+				<< ", \"p50_us\": " << stage.percentile(0.50)
+				<< ", \"p95_us\": " << stage.percentile(0.95)
+				<< ", \"p99_us\": " << stage.percentile(0.99)
+				<< ", \"max_us\": " << stage.maxMicros << " }";
 		}
-		else if (newRow < H - 1)
+		out << "\n  },\n  \"counters\": {";
+		for (int i = 0; i < COUNTER_COUNT; i++)
 		{
-			newRow = newRow + rowShift;
+			unsigned long long total = counters[i];
+			out << (i ? "," : "") << "\n    \"" << COUNTER_NAMES[i] << "\": { \"total\": " << total
+				<< ", \"per_frame\": " << (frames ? (double)total / frames : 0.0) << " }";
 		}
-		else
-			edgeEnd = true;
-		nonMax[pixelCount][0] = newRow;
-		nonMax[pixelCount][1] = newCol;
-		nonMax[pixelCount][2] = mag.at<uchar>(newRow, newCol);
-		pixelCount++;
-
+		out << "\n  }\n}\n";
 	}
+};
 
-	/* Suppress non-maximum edges */
-	max[0] = 0;
-	max[1] = 0;
-	max[2] = 0;
-	for (count = 0; count < pixelCount; count++) {
-		if (nonMax[count][2] > max[2]) {
-			max[0] = nonMax[count][0];
-			max[1] = nonMax[count][1];
-			max[2] = nonMax[count][2];
-		}
+PipelineStats &pipelineStats()
+{
+	static PipelineStats stats;
+	return stats;
+}
+
+// Adds the time from its creation to the end of the enclosing block to a stage
+class StageTimer
+{
+public:
+	StageTimer(Stage pStage)
+	{
+		stage = pStage;
+		start = chrono::steady_clock::now();
 	}
-	for (count = 0; count < pixelCount; count++) 
+
+	~StageTimer()
 	{
-		int y = nonMax[count][0];
-		int x = nonMax[count][1];
-		edges.at<uchar>(y,x) = 0;
+		pipelineStats().stages[stage].add(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
 	}
-}
 
-void edgeSuppression(Mat edges, Mat angles, Mat mag)
+private:
+	Stage stage;
+	chrono::steady_clock::time_point start;
+};
+
+/*
+	SIMDLEVEL - Widest vector instruction set the image kernels can use on this CPU
+*/
+enum SimdLevel { SIMD_NONE, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512 };	// SIMD_AVX512 also needs VPOPCNTDQ
+
+SimdLevel detectSimdLevel()
 {
-	int H = edges.rows;
-	int W = edges.cols;
-	/* Non-maximum Suppression */
-	for (int y = 1; y < H - 1; y++) 
+#if defined(IDENTIFIER_AVX2) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7)
 	{
-		for (int x = 1; x < W - 1; x++) 
-		{
-			if (edges.at<uchar>(y,x) == 255) 
-			{		// Check to see if current pixel is an edge
-					/* Switch based on current pixel's edge direction */
-				switch (angles.at<uchar>(y,x))
-				{
-				case 0:
-					suppressNonMax(edges, angles, mag, 1, 0, y, x, 0);
-					break;
-				case 45:
-					suppressNonMax(edges, angles, mag, 1, -1, y, x, 45);
-					break;
-				case 90:
-					suppressNonMax(edges, angles, mag, 0, 1, y, x, 90);
-					break;
-				case 135:
-					suppressNonMax(edges, angles, mag, 1, 1, y, x, 135);
-					break;
-				default:
-					break;
-				}
-			}
-		}
+		// the OS must also save the AVX registers on a context switch
+		__cpuid(info, 1);
+		bool osSavesAVX = (info[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6);
+		__cpuidex(info, 7, 0);
+#ifdef IDENTIFIER_AVX512
+		// and the upper halves of the ZMM registers and the mask registers
+		bool osSavesAVX512 = osSavesAVX && ((_xgetbv(0) & 0xe6) == 0xe6);
+		if (osSavesAVX512 && (info[1] & (1 << 16)) && (info[2] & (1 << 14)))
+			return SIMD_AVX512;
+#endif
+		if (osSavesAVX && (info[1] & (1 << 5)))
+			return SIMD_AVX2;
 	}
+#elif defined(IDENTIFIER_AVX2)
+	__builtin_cpu_init();
+#ifdef IDENTIFIER_AVX512
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+		return SIMD_AVX512;
+#endif
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+#endif
+#ifdef IDENTIFIER_SSE2
+	return SIMD_SSE2;
+#else
+	return SIMD_NONE;
+#endif
 }
 
-Mat translateImg(Mat &img, int offsetx, int offsety)
+// Detected once, the first time a kernel asks for it
+SimdLevel simdLevel()
 {
-	Mat trans_mat = (Mat_<double>(2, 3) << 1, 0, offsetx, 0, 1, offsety);
-	warpAffine(img, img, trans_mat, img.size());
-	return trans_mat;
+	static const SimdLevel level = detectSimdLevel();
+	return level;
 }
 
-void topSide(Mat edges, vector<Point> &edgePoints, int pTop)
+// Fixed point weights (scaled by 65536) of the grayscale formula
+// 0.1140 * b + 0.5870 * g + 0.2989 * r
+const unsigned GRAY_WEIGHT_B = 7471;
+const unsigned GRAY_WEIGHT_G = 38470;
+const unsigned GRAY_WEIGHT_R = 19589;
+
+// Converts pixels [x, width) of a row without vector instructions.
+// Each channel is shifted up 8 bits and only the top 16 bits of its product
+// are kept, exactly like the vector kernels, so every path gives the same gray.
+void grayscaleRowScalar(const uchar *colorRow, uchar *grayRow, int x, int width)
 {
-	vector<Point> tmpVec;
-	
-	for (int col = 0; col < edges.cols; col++)
+	for (; x < width; x++)
 	{
-		for (int row = 0; row <= (edges.rows / 2); row++)
-		{
-			if (edges.at<uchar>(row, col)== 255)
-			{
-				if (edgePoints.size() != 0)
-				{
-					Point tmp = edgePoints.back();
+		unsigned b = colorRow[3 * x];  //blue value of pixel
+		unsigned g = colorRow[3 * x + 1];  //green value of pixel
+		unsigned r = colorRow[3 * x + 2];  // red value of pixel
 
-					if ((abs(row - tmp.y) < 10))
-						tmpVec.push_back(Point(col, row));
-					break;
-				}
-				else
-				{
-					if (row - pTop < 20)
-					{
-						tmpVec.push_back(Point(col, row));
-					}
-				}
-			}  
-		}				   
-	}
+		unsigned gray = (((b << 8) * GRAY_WEIGHT_B) >> 16) + (((g << 8) * GRAY_WEIGHT_G) >> 16) + (((r << 8) * GRAY_WEIGHT_R) >> 16);
 
-	int size = tmpVec.size();
-	int prev = tmpVec.at(0).x;
-	int i = 1;
-	int y;
-	edgePoints.push_back(tmpVec.at(0));
-	while ( i < size )
-	{
-		int tmpX = tmpVec.at(i).x;
-		
-		if ((tmpX - prev) >= 10)
-		{
-			edgePoints.push_back(tmpVec.at(i));
-			prev = tmpX;
-			i++;
-		}
-		else
-		{
-			i++;
-		}
+		grayRow[x] = gray >> 8;
 	}
-	edgePoints.push_back(tmpVec.at(size-1));
-	
 }
 
-void rightSide(Mat edges, vector<Point> &edgePoints)
+#ifdef IDENTIFIER_SSE2
+// Splits 16 packed BGR pixels into separate blue, green and red vectors
+inline void loadBGR16(const uchar *src, __m128i &b, __m128i &g, __m128i &r)
 {
-	vector<Point> tmpVec;
-	Point start = edgePoints.back();
+	__m128i t00 = _mm_loadu_si128((const __m128i*)src);
+	__m128i t01 = _mm_loadu_si128((const __m128i*)(src + 16));
+	__m128i t02 = _mm_loadu_si128((const __m128i*)(src + 32));
 
-	for (int row = start.y; row < (edges.rows - 1); row++)
-	{
-		for (int col = edges.cols - 1; col >= (edges.cols/2); col--)
-		{
-			if (edges.at<uchar>(row, col) == 255)
-			{
-				Point tmp = edgePoints.back();
+	__m128i t10 = _mm_unpacklo_epi8(t00, _mm_unpackhi_epi64(t01, t01));
+	__m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00, t00), t02);
+	__m128i t12 = _mm_unpacklo_epi8(t01, _mm_unpackhi_epi64(t02, t02));
 
-				if ((abs(tmp.x - col) < 30))	
-				tmpVec.push_back(Point(col, row));
+	__m128i t20 = _mm_unpacklo_epi8(t10, _mm_unpackhi_epi64(t11, t11));
+	__m128i t21 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t10, t10), t12);
+	__m128i t22 = _mm_unpacklo_epi8(t11, _mm_unpackhi_epi64(t12, t12));
 
-				break;
-			}
-		}
-	}  
+	__m128i t30 = _mm_unpacklo_epi8(t20, _mm_unpackhi_epi64(t21, t21));
+	__m128i t31 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t20, t20), t22);
+	__m128i t32 = _mm_unpacklo_epi8(t21, _mm_unpackhi_epi64(t22, t22));
 
-	int size = tmpVec.size();
-	if (size != 0)
-	{
-		int prev = tmpVec.at(0).y;
-		int i = 1;
-		int y;
-		edgePoints.push_back(tmpVec.at(0));
-		while (i < size)
-		{
-			int tmpX = tmpVec.at(i).y;
+	b = _mm_unpacklo_epi8(t30, _mm_unpackhi_epi64(t31, t31));
+	g = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t30, t30), t32);
+	r = _mm_unpacklo_epi8(t31, _mm_unpackhi_epi64(t32, t32));
+}
 
-			if ((tmpX - prev) >= 10)
-			{
-				edgePoints.push_back(tmpVec.at(i));
-				prev = tmpX;
-				i++;
-			}
+// Weighted sum of 8 pixels whose channels sit in the high byte of each 16 bit lane
+inline __m128i grayscale8(__m128i b, __m128i g, __m128i r)
+{
+	__m128i sum = _mm_mulhi_epu16(b, _mm_set1_epi16((short)GRAY_WEIGHT_B));
+	sum = _mm_add_epi16(sum, _mm_mulhi_epu16(g, _mm_set1_epi16((short)GRAY_WEIGHT_G)));
+	sum = _mm_add_epi16(sum, _mm_mulhi_epu16(r, _mm_set1_epi16((short)GRAY_WEIGHT_R)));
+	return _mm_srli_epi16(sum, 8);
+}
+
+// Converts 16 pixels at a time, returns how many pixels were done
+int grayscaleRowSSE2(const uchar *colorRow, uchar *grayRow, int width)
+{
+	__m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for (; x <= width - 16; x += 16)
+	{
+		__m128i b, g, r;
+		loadBGR16(colorRow + 3 * x, b, g, r);
+
+		__m128i lo = grayscale8(_mm_unpacklo_epi8(zero, b), _mm_unpacklo_epi8(zero, g), _mm_unpacklo_epi8(zero, r));
+		__m128i hi = grayscale8(_mm_unpackhi_epi8(zero, b), _mm_unpackhi_epi8(zero, g), _mm_unpackhi_epi8(zero, r));
+		_mm_storeu_si128((__m128i*)(grayRow + x), _mm_packus_epi16(lo, hi));
+	}
+	return x;
+}
+#endif
+
+#ifdef IDENTIFIER_AVX2
+IDENTIFIER_TARGET_AVX2
+inline __m256i grayscale16(__m256i b, __m256i g, __m256i r)
+{
+	__m256i sum = _mm256_mulhi_epu16(b, _mm256_set1_epi16((short)GRAY_WEIGHT_B));
+	sum = _mm256_add_epi16(sum, _mm256_mulhi_epu16(g, _mm256_set1_epi16((short)GRAY_WEIGHT_G)));
+	sum = _mm256_add_epi16(sum, _mm256_mulhi_epu16(r, _mm256_set1_epi16((short)GRAY_WEIGHT_R)));
+	return _mm256_srli_epi16(sum, 8);
+}
+
+// Converts 32 pixels at a time, returns how many pixels were done
+IDENTIFIER_TARGET_AVX2
+int grayscaleRowAVX2(const uchar *colorRow, uchar *grayRow, int width)
+{
+	__m256i zero = _mm256_setzero_si256();
+	int x = 0;
+	for (; x <= width - 32; x += 32)
+	{
+		__m128i b0, g0, r0, b1, g1, r1;
+		loadBGR16(colorRow + 3 * x, b0, g0, r0);
+		loadBGR16(colorRow + 3 * x + 48, b1, g1, r1);
+		__m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+		__m256i g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+		__m256i r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+
+		// unpack and pack both work inside each 128 bit lane, so pixel order is kept
+		__m256i lo = grayscale16(_mm256_unpacklo_epi8(zero, b), _mm256_unpacklo_epi8(zero, g), _mm256_unpacklo_epi8(zero, r));
+		__m256i hi = grayscale16(_mm256_unpackhi_epi8(zero, b), _mm256_unpackhi_epi8(zero, g), _mm256_unpackhi_epi8(zero, r));
+		_mm256_storeu_si256((__m256i*)(grayRow + x), _mm256_packus_epi16(lo, hi));
+	}
+	return x;
+}
+#endif
+
+/*
+	GRAYSCALEROW - Converts one row of colored pixels into grayscale intensities
+	   Inputs - Row of BGR pixels, output row and the number of pixels in the row
+	   Uses the widest vector kernel the CPU supports, the rest of the row is
+	   finished one pixel at a time. Within one gray level of the double formula.
+*/
+void grayscaleRow(const Vec3b *colorRow, uchar *grayRow, int width)
+{
+	const uchar *src = (const uchar*)colorRow;
+	int x = 0;
+#ifdef IDENTIFIER_AVX2
+	if (simdLevel() >= SIMD_AVX2)
+		x = grayscaleRowAVX2(src, grayRow, width);
+#endif
+#ifdef IDENTIFIER_SSE2
+	if (simdLevel() >= SIMD_SSE2)
+		x += grayscaleRowSSE2(src + 3 * x, grayRow + x, width - x);
+#endif
+	grayscaleRowScalar(src, grayRow, x, width);
+}
+
+/*
+	GRAYSCALEIMAGE - Turns the orignal colored image into a grayscale image
+       Inputs - Colored image with RGB values in each pixel
+	   Return - Image in grayscale (CV_8U Type) 
+*/
+void toGrayscale(Mat &colorImage, Mat grayImage, ThreadPool *pool = 0)
+{
+	// convert the image one row at a time, bands of rows run in parallel
+	parallelRows(pool, 0, colorImage.rows, 16, [&](int top, int bottom)
+	{
+		for (int y = top; y < bottom; y++)
+			grayscaleRow(colorImage.ptr<Vec3b>(y), grayImage.ptr<uchar>(y), colorImage.cols);
+	});
+}
+
+// Median of nine values in 19 compare-exchange steps (Paeth/Devillard network).
+// SORT(a, b) must leave the smaller value in a and the larger one in b.
+#define MEDIAN9_NETWORK(p, SORT) \
+	SORT(p[1], p[2]); SORT(p[4], p[5]); SORT(p[7], p[8]); \
+	SORT(p[0], p[1]); SORT(p[3], p[4]); SORT(p[6], p[7]); \
+	SORT(p[1], p[2]); SORT(p[4], p[5]); SORT(p[7], p[8]); \
+	SORT(p[0], p[3]); SORT(p[5], p[8]); SORT(p[4], p[7]); \
+	SORT(p[3], p[6]); SORT(p[1], p[4]); SORT(p[2], p[5]); \
+	SORT(p[4], p[7]); SORT(p[4], p[2]); SORT(p[6], p[4]); \
+	SORT(p[4], p[2])
+
+#define SORT_PAIR(a, b) { int lo = min(a, b); b = max(a, b); a = lo; }
+
+// Median filters pixels [x, width - 1) of a row without vector instructions
+void medianRowScalar(const uchar *above, const uchar *row, const uchar *below, uchar *dst, int x, int width)
+{
+	int window[9];
+
+	for (; x < width - 1; x++)
+	{
+		// Pick up window element
+		window[0] = above[x - 1];
+		window[1] = row[x - 1];
+		window[2] = below[x - 1];
+		window[3] = above[x];
+		window[4] = row[x];
+		window[5] = below[x];
+		window[6] = above[x + 1];
+		window[7] = row[x + 1];
+		window[8] = below[x + 1];
+
+		MEDIAN9_NETWORK(window, SORT_PAIR);
+
+		// assign the median to centered element of the matrix
+		dst[x] = window[4];
+	}
+}
+
+#ifdef IDENTIFIER_SSE2
+#define SORT_PAIR_SSE2(a, b) { __m128i lo = _mm_min_epu8(a, b); b = _mm_max_epu8(a, b); a = lo; }
+
+// Median filters 16 pixels at a time starting at x = 1, returns the next x
+int medianRowSSE2(const uchar *above, const uchar *row, const uchar *below, uchar *dst, int width)
+{
+	int x = 1;
+	for (; x + 16 < width; x += 16)
+	{
+		__m128i window[9];
+		window[0] = _mm_loadu_si128((const __m128i*)(above + x - 1));
+		window[1] = _mm_loadu_si128((const __m128i*)(row + x - 1));
+		window[2] = _mm_loadu_si128((const __m128i*)(below + x - 1));
+		window[3] = _mm_loadu_si128((const __m128i*)(above + x));
+		window[4] = _mm_loadu_si128((const __m128i*)(row + x));
+		window[5] = _mm_loadu_si128((const __m128i*)(below + x));
+		window[6] = _mm_loadu_si128((const __m128i*)(above + x + 1));
+		window[7] = _mm_loadu_si128((const __m128i*)(row + x + 1));
+		window[8] = _mm_loadu_si128((const __m128i*)(below + x + 1));
+
+		MEDIAN9_NETWORK(window, SORT_PAIR_SSE2);
+
+		_mm_storeu_si128((__m128i*)(dst + x), window[4]);
+	}
+	return x;
+}
+#endif
+
+#ifdef IDENTIFIER_AVX2
+#define SORT_PAIR_AVX2(a, b) { __m256i lo = _mm256_min_epu8(a, b); b = _mm256_max_epu8(a, b); a = lo; }
+
+// Median filters 32 pixels at a time starting at x = 1, returns the next x
+IDENTIFIER_TARGET_AVX2
+int medianRowAVX2(const uchar *above, const uchar *row, const uchar *below, uchar *dst, int width)
+{
+	int x = 1;
+	for (; x + 32 < width; x += 32)
+	{
+		__m256i window[9];
+		window[0] = _mm256_loadu_si256((const __m256i*)(above + x - 1));
+		window[1] = _mm256_loadu_si256((const __m256i*)(row + x - 1));
+		window[2] = _mm256_loadu_si256((const __m256i*)(below + x - 1));
+		window[3] = _mm256_loadu_si256((const __m256i*)(above + x));
+		window[4] = _mm256_loadu_si256((const __m256i*)(row + x));
+		window[5] = _mm256_loadu_si256((const __m256i*)(below + x));
+		window[6] = _mm256_loadu_si256((const __m256i*)(above + x + 1));
+		window[7] = _mm256_loadu_si256((const __m256i*)(row + x + 1));
+		window[8] = _mm256_loadu_si256((const __m256i*)(below + x + 1));
+
+		MEDIAN9_NETWORK(window, SORT_PAIR_AVX2);
+
+		_mm256_storeu_si256((__m256i*)(dst + x), window[4]);
+	}
+	return x;
+}
+#endif
+
+// Median filters one row of the image using the rows above and below it.
+// The first and last pixel of the row are left black.
+void medianRow(const uchar *above, const uchar *row, const uchar *below, uchar *dst, int width)
+{
+	int x = 1;
+
+	dst[0] = 0;
+	dst[width - 1] = 0;
+
+#ifdef IDENTIFIER_AVX2
+	if (simdLevel() >= SIMD_AVX2)
+		x = medianRowAVX2(above, row, below, dst, width);
+#endif
+#ifdef IDENTIFIER_SSE2
+	if (simdLevel() >= SIMD_SSE2)
+		x += medianRowSSE2(above + x - 1, row + x - 1, below + x - 1, dst + x - 1, width - x + 1) - 1;
+#endif
+	medianRowScalar(above, row, below, dst, x, width);
+}
+
+// Adds (sign 1) or removes (sign -1) one pixel from a column histogram
+inline void columnHistogramUpdate(unsigned short *fine, unsigned short *coarse, uchar value, int sign)
+{
+	fine[value] += sign;
+	coarse[value >> 4] += sign;
+}
+
+/*
+	MEDIANFILTERHISTOGRAM - Median filter for any radius at constant cost per pixel
+	   Inputs - Grayscale image, output image and the radius of the square window
+	   Keeps a histogram for every column of the window rows and slides a window
+	   histogram along the row by adding one column and removing another
+	   (Perreault and Hebert). The window only keeps 16 coarse bins up to date,
+	   the 16 fine bins of a coarse bin are brought up to date when the median
+	   falls inside it. Pixels closer than radius to the border are left black.
+	   Only output rows [top, bottom) are written.
+*/
+void medianFilterHistogram(Mat src, Mat dst, int radius, int top, int bottom)
+{
+	int H = src.rows;
+	int W = src.cols;
+	int size = 2 * radius + 1;
+	int rank = size * size / 2;
+
+	for (int y = top; y < bottom; y++)
+		memset(dst.ptr<uchar>(y), 0, W);
+
+	top = max(top, radius);
+	bottom = min(bottom, H - radius);
+	if (top >= bottom || W < size)
+		return;
+
+	vector<unsigned short> columnFine(W * 256, 0);
+	vector<unsigned short> columnCoarse(W * 16, 0);
+	int coarse[16];
+	int fine[16][16];
+	int fineColumn[16];			// window position each fine segment was last updated for
+
+	// column histograms start with the rows of the first window
+	for (int y = top - radius; y < top + radius; y++)
+	{
+		const uchar *row = src.ptr<uchar>(y);
+		for (int x = 0; x < W; x++)
+			columnHistogramUpdate(&columnFine[x * 256], &columnCoarse[x * 16], row[x], 1);
+	}
+
+	for (int y = top; y < bottom; y++)
+	{
+		const uchar *entering = src.ptr<uchar>(y + radius);
+		const uchar *leaving = y > top ? src.ptr<uchar>(y - radius - 1) : 0;
+		for (int x = 0; x < W; x++)
+		{
+			columnHistogramUpdate(&columnFine[x * 256], &columnCoarse[x * 16], entering[x], 1);
+			if (leaving)
+				columnHistogramUpdate(&columnFine[x * 256], &columnCoarse[x * 16], leaving[x], -1);
+		}
+
+		memset(coarse, 0, sizeof(coarse));
+		for (int x = 0; x < size; x++)
+			for (int k = 0; k < 16; k++)
+				coarse[k] += columnCoarse[x * 16 + k];
+		for (int k = 0; k < 16; k++)
+			fineColumn[k] = -size;
+
+		uchar *out = dst.ptr<uchar>(y);
+		for (int x = radius; x < W - radius; x++)
+		{
+			if (x > radius)
+			{
+				const unsigned short *added = &columnCoarse[(x + radius) * 16];
+				const unsigned short *removed = &columnCoarse[(x - radius - 1) * 16];
+				for (int k = 0; k < 16; k++)
+					coarse[k] += added[k] - removed[k];
+			}
+
+			// coarse bin that holds the median
+			int k = 0;
+			int below = 0;
+			while (below + coarse[k] <= rank)
+				below += coarse[k++];
+
+			// bring that bin's fine histogram to the current window
+			if (x - fineColumn[k] >= size)
+			{
+				memset(fine[k], 0, sizeof(fine[k]));
+				for (int c = x - radius; c <= x + radius; c++)
+					for (int j = 0; j < 16; j++)
+						fine[k][j] += columnFine[c * 256 + k * 16 + j];
+			}
+			else
+			{
+				for (int p = fineColumn[k] + 1; p <= x; p++)
+					for (int j = 0; j < 16; j++)
+						fine[k][j] += columnFine[(p + radius) * 256 + k * 16 + j] - columnFine[(p - radius - 1) * 256 + k * 16 + j];
+			}
+			fineColumn[k] = x;
+
+			int j = 0;
+			while (below + fine[k][j] <= rank)
+				below += fine[k][j++];
+
+			out[x] = k * 16 + j;
+		}
+	}
+}
+
+/*
+	MEDIANFILTER - Blurs the grayscale image with a median filter
+	   Inputs - Grayscale image, output image and the window radius
+	   A radius of 1 (3x3) runs the vectorized sorting network, larger
+	   windows use the constant time histogram filter.
+*/
+void medianFilter(Mat src, Mat dst, int radius = 1, ThreadPool *pool = 0)
+{
+	if (radius > 1)
+	{
+		parallelRows(pool, 0, src.rows, 32, [&](int top, int bottom)
+		{
+			medianFilterHistogram(src, dst, radius, top, bottom);
+		});
+		return;
+	}
+
+	parallelRows(pool, 0, src.rows, 16, [&](int top, int bottom)
+	{
+		for (int y = top; y < bottom; y++)
+		{
+			//mark the top and bottom rows in dst image as black
+			if (y == 0 || y == src.rows - 1)
+				memset(dst.ptr<uchar>(y), 0, src.cols);
+			else
+				medianRow(src.ptr<uchar>(y - 1), src.ptr<uchar>(y), src.ptr<uchar>(y + 1), dst.ptr<uchar>(y), src.cols);
+		}
+	});
+}
+
+// tan(22.5 degrees) scaled by 32768. A gradient is horizontal (0) when
+// |gy| <= |gx| * tan(22.5) and vertical (90) when |gx| <= |gy| * tan(22.5),
+// otherwise it is one of the diagonals. Both tests are exact in integers.
+const int TAN_22_5_Q15 = 13573;
+
+// Computes the sobrel gradient for pixels [x, width - 1) of a row without
+// vector instructions
+void sobrelRowScalar(const uchar *above, const uchar *row, const uchar *below, uchar *mag, uchar *angle, int x, int width)
+{
+	for (; x < width - 1; x++)
+	{
+		int gx = above[x - 1] + 2 * row[x - 1] + below[x - 1] - above[x + 1] - 2 * row[x + 1] - below[x + 1];
+		int gy = above[x - 1] + 2 * above[x] + above[x + 1] - below[x - 1] - 2 * below[x] - below[x + 1];
+		int ax = abs(gx);
+		int ay = abs(gy);
+		int sum = ax + ay;
+		mag[x] = sum > 255 ? 255 : sum;
+
+		/* Convert actual edge direction to approximate value */
+		if (ay * 32768 <= ax * TAN_22_5_Q15)
+			angle[x] = 0;
+		else if (ax * 32768 <= ay * TAN_22_5_Q15)
+			angle[x] = 90;
+		else if ((gx ^ gy) >= 0)
+			angle[x] = 45;		// both gradients have the same sign
+		else
+			angle[x] = 135;
+	}
+}
+
+#ifdef IDENTIFIER_SSE2
+// Widens 16 bytes into two vectors of 8 signed 16 bit values
+inline void widen16(const uchar *src, __m128i &lo, __m128i &hi)
+{
+	__m128i v = _mm_loadu_si128((const __m128i*)src);
+	lo = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+	hi = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+}
+
+inline __m128i select16(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Magnitude and direction sector of 8 pixels from their 16 bit gradients
+inline void sobrelDirection8(__m128i gx, __m128i gy, __m128i &mag, __m128i &angle)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ax = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+	__m128i ay = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+	mag = _mm_add_epi16(ax, ay);
+
+	// floor(a * tan(22.5)), so comparing the other gradient against it is exact
+	__m128i tan = _mm_set1_epi16(2 * TAN_22_5_Q15);
+	__m128i horizontal = _mm_cmpeq_epi16(_mm_cmpgt_epi16(ay, _mm_mulhi_epu16(ax, tan)), zero);
+	__m128i vertical = _mm_cmpeq_epi16(_mm_cmpgt_epi16(ax, _mm_mulhi_epu16(ay, tan)), zero);
+	__m128i opposite = _mm_srai_epi16(_mm_xor_si128(gx, gy), 15);
+
+	angle = select16(opposite, _mm_set1_epi16(135), _mm_set1_epi16(45));
+	angle = select16(vertical, _mm_set1_epi16(90), angle);
+	angle = _mm_andnot_si128(horizontal, angle);
+}
+
+// Computes the gradient of 16 pixels at a time starting at x = 1, returns the next x
+int sobrelRowSSE2(const uchar *above, const uchar *row, const uchar *below, uchar *mag, uchar *angle, int width)
+{
+	int x = 1;
+	for (; x + 16 < width; x += 16)
+	{
+		__m128i a0[2], a1[2], a2[2], r0[2], r2[2], b0[2], b1[2], b2[2];
+		widen16(above + x - 1, a0[0], a0[1]);
+		widen16(above + x, a1[0], a1[1]);
+		widen16(above + x + 1, a2[0], a2[1]);
+		widen16(row + x - 1, r0[0], r0[1]);
+		widen16(row + x + 1, r2[0], r2[1]);
+		widen16(below + x - 1, b0[0], b0[1]);
+		widen16(below + x, b1[0], b1[1]);
+		widen16(below + x + 1, b2[0], b2[1]);
+
+		__m128i m[2], d[2];
+		for (int i = 0; i < 2; i++)
+		{
+			__m128i left = _mm_add_epi16(_mm_add_epi16(a0[i], b0[i]), _mm_slli_epi16(r0[i], 1));
+			__m128i right = _mm_add_epi16(_mm_add_epi16(a2[i], b2[i]), _mm_slli_epi16(r2[i], 1));
+			__m128i top = _mm_add_epi16(_mm_add_epi16(a0[i], a2[i]), _mm_slli_epi16(a1[i], 1));
+			__m128i bottom = _mm_add_epi16(_mm_add_epi16(b0[i], b2[i]), _mm_slli_epi16(b1[i], 1));
+			sobrelDirection8(_mm_sub_epi16(left, right), _mm_sub_epi16(top, bottom), m[i], d[i]);
+		}
+
+		// packing saturates the magnitude at 255
+		_mm_storeu_si128((__m128i*)(mag + x), _mm_packus_epi16(m[0], m[1]));
+		_mm_storeu_si128((__m128i*)(angle + x), _mm_packus_epi16(d[0], d[1]));
+	}
+	return x;
+}
+#endif
+
+#ifdef IDENTIFIER_AVX2
+IDENTIFIER_TARGET_AVX2
+inline void widen32(const uchar *src, __m256i &lo, __m256i &hi)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*)src);
+	lo = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
+	hi = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+}
+
+IDENTIFIER_TARGET_AVX2
+inline __m256i select32(__m256i mask, __m256i a, __m256i b)
+{
+	return _mm256_or_si256(_mm256_and_si256(mask, a), _mm256_andnot_si256(mask, b));
+}
+
+IDENTIFIER_TARGET_AVX2
+inline void sobrelDirection16(__m256i gx, __m256i gy, __m256i &mag, __m256i &angle)
+{
+	__m256i ax = _mm256_abs_epi16(gx);
+	__m256i ay = _mm256_abs_epi16(gy);
+	mag = _mm256_add_epi16(ax, ay);
+
+	__m256i tan = _mm256_set1_epi16(2 * TAN_22_5_Q15);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i horizontal = _mm256_cmpeq_epi16(_mm256_cmpgt_epi16(ay, _mm256_mulhi_epu16(ax, tan)), zero);
+	__m256i vertical = _mm256_cmpeq_epi16(_mm256_cmpgt_epi16(ax, _mm256_mulhi_epu16(ay, tan)), zero);
+	__m256i opposite = _mm256_srai_epi16(_mm256_xor_si256(gx, gy), 15);
+
+	angle = select32(opposite, _mm256_set1_epi16(135), _mm256_set1_epi16(45));
+	angle = select32(vertical, _mm256_set1_epi16(90), angle);
+	angle = _mm256_andnot_si256(horizontal, angle);
+}
+
+// Computes the gradient of 32 pixels at a time starting at x = 1, returns the next x
+IDENTIFIER_TARGET_AVX2
+int sobrelRowAVX2(const uchar *above, const uchar *row, const uchar *below, uchar *mag, uchar *angle, int width)
+{
+	int x = 1;
+	for (; x + 32 < width; x += 32)
+	{
+		__m256i a0[2], a1[2], a2[2], r0[2], r2[2], b0[2], b1[2], b2[2];
+		widen32(above + x - 1, a0[0], a0[1]);
+		widen32(above + x, a1[0], a1[1]);
+		widen32(above + x + 1, a2[0], a2[1]);
+		widen32(row + x - 1, r0[0], r0[1]);
+		widen32(row + x + 1, r2[0], r2[1]);
+		widen32(below + x - 1, b0[0], b0[1]);
+		widen32(below + x, b1[0], b1[1]);
+		widen32(below + x + 1, b2[0], b2[1]);
+
+		__m256i m[2], d[2];
+		for (int i = 0; i < 2; i++)
+		{
+			__m256i left = _mm256_add_epi16(_mm256_add_epi16(a0[i], b0[i]), _mm256_slli_epi16(r0[i], 1));
+			__m256i right = _mm256_add_epi16(_mm256_add_epi16(a2[i], b2[i]), _mm256_slli_epi16(r2[i], 1));
+			__m256i top = _mm256_add_epi16(_mm256_add_epi16(a0[i], a2[i]), _mm256_slli_epi16(a1[i], 1));
+			__m256i bottom = _mm256_add_epi16(_mm256_add_epi16(b0[i], b2[i]), _mm256_slli_epi16(b1[i], 1));
+			sobrelDirection16(_mm256_sub_epi16(left, right), _mm256_sub_epi16(top, bottom), m[i], d[i]);
+		}
+
+		// unpack and pack both work inside each 128 bit lane, so pixel order is kept
+		_mm256_storeu_si256((__m256i*)(mag + x), _mm256_packus_epi16(m[0], m[1]));
+		_mm256_storeu_si256((__m256i*)(angle + x), _mm256_packus_epi16(d[0], d[1]));
+	}
+	return x;
+}
+#endif
+
+// Computes the sobrel gradient for one row of the image using the rows
+// above and below it. The first and last pixel of the row get no gradient.
+void sobrelRow(const uchar *above, const uchar *row, const uchar *below, uchar *mag, uchar *angle, int width)
+{
+	int x = 1;
+
+	mag[0] = 0;
+	mag[width - 1] = 0;
+
+#ifdef IDENTIFIER_AVX2
+	if (simdLevel() >= SIMD_AVX2)
+		x = sobrelRowAVX2(above, row, below, mag, angle, width);
+#endif
+#ifdef IDENTIFIER_SSE2
+	if (simdLevel() >= SIMD_SSE2)
+		x += sobrelRowSSE2(above + x - 1, row + x - 1, below + x - 1, mag + x - 1, angle + x - 1, width - x + 1) - 1;
+#endif
+	sobrelRowScalar(above, row, below, mag, angle, x, width);
+}
+
+void sobrelFilter(Mat src, Mat mag, Mat angle, ThreadPool *pool = 0)
+{
+	parallelRows(pool, 0, src.rows, 16, [&](int top, int bottom)
+	{
+		for (int y = top; y < bottom; y++)
+		{
+			if (y == 0 || y == src.rows - 1)
+				memset(mag.ptr<uchar>(y), 0, src.cols);
 			else
+				sobrelRow(src.ptr<uchar>(y - 1), src.ptr<uchar>(y), src.ptr<uchar>(y + 1), mag.ptr<uchar>(y), angle.ptr<uchar>(y), src.cols);
+		}
+	});
+}
+
+// Runs the fused pass for magnitude and angle rows [top, bottom). The two
+// gray rows and one blurred row on each side of the band are recomputed, so
+// bands can run at the same time and still match a single pass exactly.
+void fusedPreprocessRows(Mat &colorImage, Mat mag, Mat angle, int top, int bottom)
+{
+	int H = colorImage.rows;
+	int W = colorImage.cols;
+	int first = max(top - 2, 0);
+	int last = min(bottom + 1, H);
+
+	vector<uchar> buffer(6 * W);
+	uchar *gray[3] = { &buffer[0], &buffer[W], &buffer[2 * W] };
+	uchar *blur[3] = { &buffer[3 * W], &buffer[4 * W], &buffer[5 * W] };
+
+	if (top == 0)
+		memset(mag.ptr<uchar>(0), 0, W);
+	if (bottom == H)
+		memset(mag.ptr<uchar>(H - 1), 0, W);
+
+	// one extra step flushes the last blurred row through the sobrel filter
+	for (int y = first; y <= last; y++)
+	{
+		if (y < H)
+			grayscaleRow(colorImage.ptr<Vec3b>(y), gray[y % 3], W);
+
+		// gray rows around blur row b are now available
+		int b = y - 1;
+		if (b == 0 || b == H - 1)
+			memset(blur[b % 3], 0, W);
+		else if (b > first)
+			medianRow(gray[(b - 1) % 3], gray[b % 3], gray[(b + 1) % 3], blur[b % 3], W);
+
+		// blur rows around sobrel row s are now available
+		int s = y - 2;
+		if (s >= max(top, 1) && s < min(bottom, H - 1))
+			sobrelRow(blur[(s - 1) % 3], blur[s % 3], blur[(s + 1) % 3], mag.ptr<uchar>(s), angle.ptr<uchar>(s), W);
+	}
+}
+
+/*
+	FUSEDPREPROCESS - Runs grayscale, median filter and sobrel filter in a single pass
+	   Inputs - Colored image, magnitude and angle images (CV_8U) to fill and the
+	   pool that runs bands of rows in parallel
+	   The image is streamed through three row buffers of gray values and three of
+	   blurred values, so each row is filtered while it is still in cache and the
+	   full size gray and blur images are never created. Output matches running
+	   toGrayscale, medianFilter and sobrelFilter one after another.
+*/
+void fusedPreprocess(Mat &colorImage, Mat mag, Mat angle, ThreadPool *pool = 0)
+{
+	if (colorImage.rows < 3 || colorImage.cols < 3)
+	{
+		mag.setTo(Scalar(0));
+		return;
+	}
+
+	parallelRows(pool, 0, colorImage.rows, 32, [&](int top, int bottom)
+	{
+		fusedPreprocessRows(colorImage, mag, angle, top, bottom);
+	});
+}
+
+/*
+	CLEARBORDERBAND - Removes the gradients made by the black border of the median filter
+	   Inputs - gradient magnitudes and the median window radius
+	   The median filter leaves radius pixels black on every side, so the
+	   sobrel filter sees a step from the background down to black one pixel
+	   further in. Those pixels are cleared too, so no edge starts or runs
+	   along the frame and a uniform frame has no edges at all.
+*/
+void clearBorderBand(Mat mag, int radius)
+{
+	int H = mag.rows;
+	int W = mag.cols;
+	int band = radius + 1;
+	if (2 * band >= H || 2 * band >= W)
+	{
+		mag.setTo(Scalar(0));
+		return;
+	}
+
+	for (int y = 0; y < H; y++)
+	{
+		uchar *row = mag.ptr<uchar>(y);
+		if (y < band || y >= H - band)
+			memset(row, 0, W);
+		else
+		{
+			memset(row, 0, band);
+			memset(row + W - band, 0, band);
+		}
+	}
+}
+
+// Marks the walk maps of the legacy edge walks where no walk may step: pixels
+// that are not part of any edge and the one pixel border around the image
+const uchar NOT_WALKABLE = 255;
+
+// Fills a walk map one pixel larger than the image on every side. Pixels the
+// walk may step on hold their angle, every other one NOT_WALKABLE, so a walk
+// stops at the border the same way it stops at the end of an edge.
+template <class Walkable>
+void buildWalkMap(vector<uchar> &walk, int H, int W, Walkable walkable, Mat angle)
+{
+	int step = W + 2;
+	walk.assign((size_t)(H + 2) * step, NOT_WALKABLE);
+	for (int y = 0; y < H; y++)
+	{
+		const uchar *angleRow = angle.ptr<uchar>(y);
+		uchar *walkRow = &walk[(y + 1) * step + 1];
+		for (int x = 0; x < W; x++)
+			if (walkable(y, x))
+				walkRow[x] = angleRow[x];
+	}
+}
+
+/*
+	FINDEDGE - Marks the pixels past a strong one that continue its edge
+	   Steps ROW_SHIFT rows and COL_SHIFT columns at a time from the walk map
+	   index start while the pixels are strong enough and point the same way.
+	   The steps are fixed when compiled and the map border ends the walk, so
+	   the loop is a compare, a store and two additions.
+*/
+template <int ROW_SHIFT, int COL_SHIFT, int DIR>
+void findEdge(const uchar *walk, int walkStep, uchar *edges, size_t edgesStep, ptrdiff_t start, ptrdiff_t edgesStart)
+{
+	const ptrdiff_t walkDelta = ROW_SHIFT * (ptrdiff_t)walkStep + COL_SHIFT;
+	const ptrdiff_t edgesDelta = ROW_SHIFT * (ptrdiff_t)edgesStep + COL_SHIFT;
+	ptrdiff_t i = start + walkDelta;
+	ptrdiff_t e = edgesStart + edgesDelta;
+	while (walk[i] == DIR)
+	{
+		edges[e] = 255;
+		i += walkDelta;
+		e += edgesDelta;
+	}
+}
+
+void traceEdge(Mat mag, Mat angle, Mat edges, int upperThreshold, int lowerThreshold)
+{
+	int H = mag.rows;
+	int W = mag.cols;
+	int step = W + 2;
+
+	// pixels an edge may continue through, kept by the thread between frames
+	static thread_local vector<uchar> walk;
+	buildWalkMap(walk, H, W, [&](int y, int x) { return mag.at<uchar>(y, x) > lowerThreshold; }, angle);
+	uchar *edgesData = edges.ptr<uchar>(0);
+	size_t edgesStep = edges.step;
+
+	/* Trace along all the edges in the image */
+	for (int y = 1; y < H - 1; y++)
+	{
+		const uchar *magRow = mag.ptr<uchar>(y);
+		const uchar *angleRow = angle.ptr<uchar>(y);
+		for (int x = 1; x < W - 1; x++) 
+		{
+			// Check to see if current pixel has a high enough gradient strength to be part of an edge
+			if (magRow[x] <= upperThreshold)
+				continue;
+
+			ptrdiff_t start = (ptrdiff_t)(y + 1) * step + x + 1;
+			ptrdiff_t edgesStart = (ptrdiff_t)y * edgesStep + x;
+			/* Switch based on current pixel's edge direction */
+			switch (angleRow[x]) 
+			{			
+			case 0:
+				findEdge<0, 1, 0>(&walk[0], step, edgesData, edgesStep, start, edgesStart);
+				break;
+			case 45:
+				findEdge<1, 1, 45>(&walk[0], step, edgesData, edgesStep, start, edgesStart);
+				break;
+			case 90:
+				findEdge<1, 0, 90>(&walk[0], step, edgesData, edgesStep, start, edgesStart);
+				break;
+			case 135:
+				findEdge<1, -1, 135>(&walk[0], step, edgesData, edgesStep, start, edgesStart);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+// Grows edges from the pixels on the stack to every connected pixel that is
+// stronger than lowerThreshold and lies in rows [top, bottom). Each pixel is
+// pushed at most once because it is marked before it goes on the stack.
+// Returns the number of pixels it marked.
+int growEdges(Mat mag, Mat edges, vector<int> &stack, int top, int bottom, int lowerThreshold)
+{
+	int W = mag.cols;
+	int marked = 0;
+
+	while (!stack.empty())
+	{
+		int y = stack.back() / W;
+		int x = stack.back() % W;
+		stack.pop_back();
+
+		for (int ny = max(y - 1, top); ny <= min(y + 1, bottom - 1); ny++)
+		{
+			const uchar *magRow = mag.ptr<uchar>(ny);
+			uchar *edgeRow = edges.ptr<uchar>(ny);
+			for (int nx = max(x - 1, 0); nx <= min(x + 1, W - 1); nx++)
 			{
-				i++;
+				if (edgeRow[nx] == 0 && magRow[nx] > lowerThreshold)
+				{
+					edgeRow[nx] = 255;
+					stack.push_back(ny * W + nx);
+					marked++;
+				}
+			}
+		}
+	}
+	return marked;
+}
+
+/*
+	HYSTERESISTRACE - Marks edges as every pixel connected to a strong gradient
+	   Inputs - Gradient magnitudes, edge image to fill, the threshold a pixel must
+	   pass to start an edge and the threshold to continue one
+	   The image is split into bands of rows that are traced in parallel, then
+	   edges that touch a band seam are grown across it. The result is the same
+	   for any number of bands and does not depend on scan order.
+*/
+void hysteresisTrace(Mat mag, Mat edges, int upperThreshold, int lowerThreshold, ThreadPool *pool)
+{
+	int H = mag.rows;
+	int W = mag.cols;
+	vector<int> bandTop = rowBands(pool, 0, H, 32);
+	int bands = (int)bandTop.size() - 1;
+
+	function<void(int)> traceBand = [&](int band)
+	{
+		int top = bandTop[band];
+		int bottom = bandTop[band + 1];
+		vector<int> stack;
+		int marked = 0;
+
+		for (int y = top; y < bottom; y++)
+			memset(edges.ptr<uchar>(y), 0, W);
+
+		for (int y = top; y < bottom; y++)
+		{
+			const uchar *magRow = mag.ptr<uchar>(y);
+			uchar *edgeRow = edges.ptr<uchar>(y);
+			for (int x = 0; x < W; x++)
+			{
+				if (magRow[x] > upperThreshold && edgeRow[x] == 0)
+				{
+					edgeRow[x] = 255;
+					stack.push_back(y * W + x);
+					marked += 1 + growEdges(mag, edges, stack, top, bottom, lowerThreshold);
+				}
 			}
 		}
-		edgePoints.push_back(tmpVec.at(size - 1));
+		pipelineStats().count(COUNT_EDGE_PIXELS, marked);
+	};
+
+	if (bands > 1)
+		pool->parallelFor(bands, traceBand);
+	else
+		traceBand(0);
+
+	/* Continue edges that stopped at a seam into the neighbouring band */
+	vector<int> stack;
+	int marked = 0;
+	for (int i = 1; i < bands; i++)
+	{
+		int seam = bandTop[i];
+		for (int side = 0; side < 2; side++)
+		{
+			int from = side == 0 ? seam - 1 : seam;
+			int to = side == 0 ? seam : seam - 1;
+			const uchar *fromRow = edges.ptr<uchar>(from);
+			const uchar *magRow = mag.ptr<uchar>(to);
+			uchar *toRow = edges.ptr<uchar>(to);
+
+			for (int x = 0; x < W; x++)
+			{
+				if (fromRow[x] != 255)
+					continue;
+				for (int nx = max(x - 1, 0); nx <= min(x + 1, W - 1); nx++)
+				{
+					if (toRow[nx] == 0 && magRow[nx] > lowerThreshold)
+					{
+						toRow[nx] = 255;
+						stack.push_back(to * W + nx);
+						marked++;
+					}
+				}
+			}
+		}
+	}
+	marked += growEdges(mag, edges, stack, 0, H, lowerThreshold);
+	pipelineStats().count(COUNT_EDGE_PIXELS, marked);
+}
+
+/*
+	FINDNONMAX - Collects the pixels to suppress on one side of an edge pixel
+	   Walks from the walk map index start while the edge runs on in the same
+	   direction and keeps every pixel after the first, up to and including
+	   the one that ends the run. That last one is kept as an index of the
+	   border when the run reaches the edge of the image.
+*/
+template <int ROW_SHIFT, int COL_SHIFT, int DIR>
+void findNonMax(const uchar *walk, int walkStep, ptrdiff_t start, vector<ptrdiff_t> &nonMax)
+{
+	const ptrdiff_t delta = ROW_SHIFT * (ptrdiff_t)walkStep + COL_SHIFT;
+	ptrdiff_t i = start + delta;
+	if (walk[i] != DIR)
+		return;
+	do
+	{
+		i += delta;
+		nonMax.push_back(i);
+	} while (walk[i] == DIR);
+}
+
+/*
+	SUPPRESSNONMAX - Removes the parallel edges on both sides of an edge pixel
+	   The pixels are only removed after both sides are walked, so each side
+	   sees the edges as they were before this pixel.
+*/
+template <int ROW_SHIFT, int COL_SHIFT, int DIR>
+void suppressNonMax(uchar *walk, int walkStep, Mat &edges, ptrdiff_t start, vector<ptrdiff_t> &nonMax)
+{
+	nonMax.clear();
+	findNonMax<ROW_SHIFT, COL_SHIFT, DIR>(walk, walkStep, start, nonMax);
+	findNonMax<-ROW_SHIFT, -COL_SHIFT, DIR>(walk, walkStep, start, nonMax);
+
+	/* Suppress non-maximum edges */
+	for (size_t count = 0; count < nonMax.size(); count++) 
+	{
+		// a run that reached the border ends on the nearest pixel inside it
+		int row = min(max((int)(nonMax[count] / walkStep) - 1, 0), edges.rows - 1);
+		int col = min(max((int)(nonMax[count] % walkStep) - 1, 0), edges.cols - 1);
+		edges.at<uchar>(row, col) = 0;
+		walk[(ptrdiff_t)(row + 1) * walkStep + col + 1] = NOT_WALKABLE;
+	}
+}
+
+void edgeSuppression(Mat edges, Mat angles)
+{
+	int H = edges.rows;
+	int W = edges.cols;
+	int step = W + 2;
+
+	// edge pixels hold their angle, kept by the thread between frames with
+	// the list of pixels to suppress
+	static thread_local vector<uchar> walk;
+	static thread_local vector<ptrdiff_t> nonMax;
+	buildWalkMap(walk, H, W, [&](int y, int x) { return edges.at<uchar>(y, x) == 255; }, angles);
+
+	/* Non-maximum Suppression */
+	for (int y = 1; y < H - 1; y++) 
+	{
+		for (int x = 1; x < W - 1; x++) 
+		{
+			// Check to see if current pixel is an edge
+			ptrdiff_t start = (ptrdiff_t)(y + 1) * step + x + 1;
+			/* Switch based on current pixel's edge direction */
+			switch (walk[start])
+			{
+			case 0:
+				suppressNonMax<1, 0, 0>(&walk[0], step, edges, start, nonMax);
+				break;
+			case 45:
+				suppressNonMax<1, -1, 45>(&walk[0], step, edges, start, nonMax);
+				break;
+			case 90:
+				suppressNonMax<0, 1, 90>(&walk[0], step, edges, start, nonMax);
+				break;
+			case 135:
+				suppressNonMax<1, 1, 135>(&walk[0], step, edges, start, nonMax);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+// Keeps an edge pixel only if its gradient is larger than the neighbour before
+// it along the gradient direction and at least as large as the one after it
+inline uchar keepMaximum(uchar m, uchar before, uchar after)
+{
+	return (m > before && m >= after) ? 255 : 0;
+}
+
+// Suppresses pixels [x, width - 1) of an edge row without vector instructions,
+// returns how many edge pixels were removed
+int nonMaxRowScalar(const uchar *above, const uchar *row, const uchar *below, const uchar *angle, uchar *edges, int x, int width)
+{
+	int removed = 0;
+	for (; x < width - 1; x++)
+	{
+		uchar before = 0;
+		uchar after = 0;
+		switch (angle[x])
+		{
+		case 0:
+			before = row[x - 1];
+			after = row[x + 1];
+			break;
+		case 45:
+			before = above[x - 1];
+			after = below[x + 1];
+			break;
+		case 90:
+			before = above[x];
+			after = below[x];
+			break;
+		case 135:
+			before = above[x + 1];
+			after = below[x - 1];
+			break;
+		default:
+			break;
+		}
+		uchar kept = edges[x] & keepMaximum(row[x], before, after);
+		removed += kept != edges[x];
+		edges[x] = kept;
+	}
+	return removed;
+}
+
+#ifdef IDENTIFIER_SSE2
+// Suppresses 16 pixels at a time starting at x = 1, returns the next x and
+// adds the number of removed edge pixels to removed
+int nonMaxRowSSE2(const uchar *above, const uchar *row, const uchar *below, const uchar *angle, uchar *edges, int width, int &removed)
+{
+	int x = 1;
+	for (; x + 16 < width; x += 16)
+	{
+		__m128i dir = _mm_loadu_si128((const __m128i*)(angle + x));
+		__m128i is0 = _mm_cmpeq_epi8(dir, _mm_setzero_si128());
+		__m128i is45 = _mm_cmpeq_epi8(dir, _mm_set1_epi8(45));
+		__m128i is90 = _mm_cmpeq_epi8(dir, _mm_set1_epi8(90));
+		__m128i is135 = _mm_cmpeq_epi8(dir, _mm_set1_epi8((char)135));
+
+		__m128i before = _mm_and_si128(is0, _mm_loadu_si128((const __m128i*)(row + x - 1)));
+		before = _mm_or_si128(before, _mm_and_si128(is45, _mm_loadu_si128((const __m128i*)(above + x - 1))));
+		before = _mm_or_si128(before, _mm_and_si128(is90, _mm_loadu_si128((const __m128i*)(above + x))));
+		before = _mm_or_si128(before, _mm_and_si128(is135, _mm_loadu_si128((const __m128i*)(above + x + 1))));
+
+		__m128i after = _mm_and_si128(is0, _mm_loadu_si128((const __m128i*)(row + x + 1)));
+		after = _mm_or_si128(after, _mm_and_si128(is45, _mm_loadu_si128((const __m128i*)(below + x + 1))));
+		after = _mm_or_si128(after, _mm_and_si128(is90, _mm_loadu_si128((const __m128i*)(below + x))));
+		after = _mm_or_si128(after, _mm_and_si128(is135, _mm_loadu_si128((const __m128i*)(below + x - 1))));
+
+		// unsigned m > before and m >= after through max, SSE2 has no unsigned compare
+		__m128i m = _mm_loadu_si128((const __m128i*)(row + x));
+		__m128i notAbove = _mm_cmpeq_epi8(_mm_max_epu8(before, m), before);
+		__m128i atLeast = _mm_cmpeq_epi8(_mm_max_epu8(m, after), m);
+		__m128i keep = _mm_andnot_si128(notAbove, atLeast);
+
+		__m128i e = _mm_loadu_si128((const __m128i*)(edges + x));
+		_mm_storeu_si128((__m128i*)(edges + x), _mm_and_si128(e, keep));
+		removed += (int)bitset<16>(_mm_movemask_epi8(_mm_andnot_si128(keep, e))).count();
+	}
+	return x;
+}
+#endif
+
+#ifdef IDENTIFIER_AVX2
+// Suppresses 32 pixels at a time starting at x = 1, returns the next x and
+// adds the number of removed edge pixels to removed
+IDENTIFIER_TARGET_AVX2
+int nonMaxRowAVX2(const uchar *above, const uchar *row, const uchar *below, const uchar *angle, uchar *edges, int width, int &removed)
+{
+	int x = 1;
+	for (; x + 32 < width; x += 32)
+	{
+		__m256i dir = _mm256_loadu_si256((const __m256i*)(angle + x));
+		__m256i is0 = _mm256_cmpeq_epi8(dir, _mm256_setzero_si256());
+		__m256i is45 = _mm256_cmpeq_epi8(dir, _mm256_set1_epi8(45));
+		__m256i is90 = _mm256_cmpeq_epi8(dir, _mm256_set1_epi8(90));
+		__m256i is135 = _mm256_cmpeq_epi8(dir, _mm256_set1_epi8((char)135));
+
+		__m256i before = _mm256_and_si256(is0, _mm256_loadu_si256((const __m256i*)(row + x - 1)));
+		before = _mm256_or_si256(before, _mm256_and_si256(is45, _mm256_loadu_si256((const __m256i*)(above + x - 1))));
+		before = _mm256_or_si256(before, _mm256_and_si256(is90, _mm256_loadu_si256((const __m256i*)(above + x))));
+		before = _mm256_or_si256(before, _mm256_and_si256(is135, _mm256_loadu_si256((const __m256i*)(above + x + 1))));
+
+		__m256i after = _mm256_and_si256(is0, _mm256_loadu_si256((const __m256i*)(row + x + 1)));
+		after = _mm256_or_si256(after, _mm256_and_si256(is45, _mm256_loadu_si256((const __m256i*)(below + x + 1))));
+		after = _mm256_or_si256(after, _mm256_and_si256(is90, _mm256_loadu_si256((const __m256i*)(below + x))));
+		after = _mm256_or_si256(after, _mm256_and_si256(is135, _mm256_loadu_si256((const __m256i*)(below + x - 1))));
+
+		__m256i m = _mm256_loadu_si256((const __m256i*)(row + x));
+		__m256i notAbove = _mm256_cmpeq_epi8(_mm256_max_epu8(before, m), before);
+		__m256i atLeast = _mm256_cmpeq_epi8(_mm256_max_epu8(m, after), m);
+		__m256i keep = _mm256_andnot_si256(notAbove, atLeast);
+
+		__m256i e = _mm256_loadu_si256((const __m256i*)(edges + x));
+		_mm256_storeu_si256((__m256i*)(edges + x), _mm256_and_si256(e, keep));
+		removed += (int)bitset<32>((unsigned)_mm256_movemask_epi8(_mm256_andnot_si256(keep, e))).count();
+	}
+	return x;
+}
+#endif
+
+// Thins one row of edges using the gradient rows above and below it,
+// returns how many edge pixels were removed
+int nonMaxRow(const uchar *above, const uchar *row, const uchar *below, const uchar *angle, uchar *edges, int width)
+{
+	int x = 1;
+	int removed = 0;
+#ifdef IDENTIFIER_AVX2
+	if (simdLevel() >= SIMD_AVX2)
+		x = nonMaxRowAVX2(above, row, below, angle, edges, width, removed);
+#endif
+#ifdef IDENTIFIER_SSE2
+	if (simdLevel() >= SIMD_SSE2)
+		x += nonMaxRowSSE2(above + x - 1, row + x - 1, below + x - 1, angle + x - 1, edges + x - 1, width - x + 1, removed) - 1;
+#endif
+	return removed + nonMaxRowScalar(above, row, below, angle, edges, x, width);
+}
+
+/*
+	NONMAXSUPPRESSION - Thins edges to the pixels with the strongest gradient across them
+	   Inputs - Edge image, quantized gradient directions and gradient magnitudes
+	   Every edge pixel is compared with its two neighbours along the gradient,
+	   which only reads the magnitudes, so rows are independent and are split
+	   between the threads of the pool. Works in place at any image size.
+*/
+void nonMaxSuppression(Mat edges, Mat angle, Mat mag, ThreadPool *pool)
+{
+	int H = edges.rows;
+	int W = edges.cols;
+	if (H < 3 || W < 3)
+		return;
+
+	parallelRows(pool, 1, H - 1, 16, [&](int top, int bottom)
+	{
+		int removed = 0;
+		for (int y = top; y < bottom; y++)
+			removed += nonMaxRow(mag.ptr<uchar>(y - 1), mag.ptr<uchar>(y), mag.ptr<uchar>(y + 1), angle.ptr<uchar>(y), edges.ptr<uchar>(y), W);
+		pipelineStats().count(COUNT_SUPPRESSED_PIXELS, removed);
+	});
+}
+
+// The 8 neighbours of a pixel in clockwise order, starting east
+const int MOORE_DX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+const int MOORE_DY[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+
+/*
+	TRACEBOUNDARY - Follows the outer boundary of the edge that start is on
+	   Moore neighbour tracing from the topmost, leftmost pixel of the edge,
+	   walking clockwise until it would leave that pixel the way it first
+	   did. Only the boundary pixels are visited.
+	   Return - the boundary pixels in order
+*/
+vector<Point> traceBoundary(Mat &edges, Point start)
+{
+	vector<Point> contour;
+	int H = edges.rows;
+	int W = edges.cols;
+
+	Point p = start;
+	int back = 4;			// came from the west
+	int firstMove = -1;
+	contour.push_back(start);
+	while (true)
+	{
+		// the first edge pixel clockwise from the one we came from
+		int move = -1;
+		for (int k = 1; k <= 8 && move < 0; k++)
+		{
+			int d = (back + k) & 7;
+			int x = p.x + MOORE_DX[d];
+			int y = p.y + MOORE_DY[d];
+			if (x >= 0 && x < W && y >= 0 && y < H && edges.at<uchar>(y, x) == 255)
+				move = d;
+		}
+		if (move < 0)
+			break;			// a single pixel
+		if (p == start && move == firstMove)
+			break;			// around once
+		if (firstMove < 0)
+			firstMove = move;
+
+		p = Point(p.x + MOORE_DX[move], p.y + MOORE_DY[move]);
+		// the pixel checked before this one, as seen from the new position
+		back = (move + ((move & 1) ? 5 : 6)) & 7;
+		if (p != start)
+			contour.push_back(p);
+	}
+	return contour;
+}
+
+// Sets every pixel of the edge that start is on to mark
+void markEdge(Mat &edges, Point start, uchar mark, vector<Point> &stack)
+{
+	int H = edges.rows;
+	int W = edges.cols;
+	stack.clear();
+	stack.push_back(start);
+	edges.at<uchar>(start.y, start.x) = mark;
+	while (!stack.empty())
+	{
+		Point p = stack.back();
+		stack.pop_back();
+		for (int d = 0; d < 8; d++)
+		{
+			int x = p.x + MOORE_DX[d];
+			int y = p.y + MOORE_DY[d];
+			if (x >= 0 && x < W && y >= 0 && y < H && edges.at<uchar>(y, x) == 255)
+			{
+				edges.at<uchar>(y, x) = mark;
+				stack.push_back(Point(x, y));
+			}
+		}
+	}
+}
+
+/*
+	EDGEBOUNDS - Finds the smallest rectangle holding every edge pixel
+	   One pass over the image: every row is folded into a column projection
+	   with a byte maximum, so a row or column holds an edge when its
+	   maximum is 255.
+	   Return - the bounding box, empty if there are no edges
+*/
+Rect edgeBounds(Mat &edges)
+{
+	int H = edges.rows;
+	int W = edges.cols;
+	if (H == 0 || W == 0)
+		return Rect();
+
+	vector<uchar> columns(W, 0);
+	uchar *column = &columns[0];
+	int top = -1;
+	int bottom = -1;
+	for (int y = 0; y < H; y++)
+	{
+		const uchar *row = edges.ptr<uchar>(y);
+		uchar rowMax = 0;
+		int x = 0;
+#ifdef IDENTIFIER_SSE2
+		__m128i any = _mm_setzero_si128();
+		for (; x + 16 <= W; x += 16)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+			any = _mm_max_epu8(any, pixels);
+			_mm_storeu_si128((__m128i*)(column + x), _mm_max_epu8(_mm_loadu_si128((const __m128i*)(column + x)), pixels));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_set1_epi8((char)255))))
+			rowMax = 255;
+#endif
+		for (; x < W; x++)
+		{
+			rowMax = max(rowMax, row[x]);
+			column[x] = max(column[x], row[x]);
+		}
+
+		if (rowMax == 255)
+		{
+			if (top < 0)
+				top = y;
+			bottom = y;
+		}
+	}
+	if (top < 0)
+		return Rect();
+
+	int left = 0;
+	while (column[left] != 255)
+		left++;
+	int right = W - 1;
+	while (column[right] != 255)
+		right--;
+
+	return Rect(left, top, right - left + 1, bottom - top + 1);
+}
+
+/*
+	OBJECTBOUNDARY - Finds the outer boundary of the object among all the edges
+	   Every edge is traced from its first pixel in row order and then
+	   marked, so the next one is found by carrying on with the scan. The
+	   object is the edge that encloses the largest area. Edges that reach
+	   the border of the frame are never used, a cut off object cannot be
+	   identified anyway.
+	   Inputs - edges, which are overwritten with the marks, where they are
+	            in the frame and the frame size
+	   Return - the boundary pixels in frame coordinates, empty if every edge
+	            reaches the border
+*/
+vector<Point> objectBoundary(Mat &edges, Point offset, Size frame)
+{
+	static thread_local vector<Point> stack;
+	vector<Point> best;
+	double bestArea = -1;
+	int H = edges.rows;
+	int W = edges.cols;
+
+	for (int y = 0; y < H; y++)
+	{
+		uchar *row = edges.ptr<uchar>(y);
+		uchar *found = row;
+		while ((found = (uchar*)memchr(found, 255, W - (found - row))) != 0)
+		{
+			// the first pixel of an edge in row order has no edge above it or to its left
+			Point start((int)(found - row), y);
+			vector<Point> contour = traceBoundary(edges, start);
+			markEdge(edges, start, 128, stack);
+
+			bool inside = true;
+			for (size_t i = 0; i < contour.size(); i++)
+			{
+				contour[i] += offset;
+				inside = inside && contour[i].x > 0 && contour[i].y > 0 && contour[i].x < frame.width - 1 && contour[i].y < frame.height - 1;
+			}
+			double area = contourArea(contour);
+			if (inside && area > bestArea)
+			{
+				best.swap(contour);
+				bestArea = area;
+			}
+		}
+	}
+	return best;
+}
+
+/*
+	OUTLINE - Fills the object outlined by the edges in the image
+	   Inputs - thinned edges, the image to draw the filled object into and
+	            how far in pixels the polygon may cut corners, 0 for none
+	   The edges are grown by a pixel first, so an outline with one pixel
+	   gaps still closes, and the filled object is shrunk back by a pixel.
+	   Both only run around the edges found, not over the whole image.
+*/
+void outline(Mat edges, Mat img, double tolerance)
+{
+	static thread_local Mat bridged;
+	img.setTo(Scalar(0));
+	Rect box = edgeBounds(edges);
+	if (box.area() == 0)
+	{
+		pipelineStats().count(COUNT_CONTOUR_POINTS, 0);
+		return;
+	}
+
+	// two pixels more, so the grown edges and the filled object never reach the side
+	Rect around = Rect(box.x - 2, box.y - 2, box.width + 4, box.height + 4) & Rect(0, 0, edges.cols, edges.rows);
+	dilate(edges(around), bridged, Mat());
+	vector<Point> edgePoints = objectBoundary(bridged, around.tl(), edges.size());
+	pipelineStats().count(COUNT_CONTOUR_POINTS, edgePoints.size());
+	if (edgePoints.empty())
+		return;
+
+	if (tolerance > 0 && edgePoints.size() > 2)
+	{
+		vector<Point> simplified;
+		approxPolyDP(edgePoints, simplified, tolerance, true);
+		edgePoints.swap(simplified);
+	}
+	
+	const Point *pts = &edgePoints[0];
+	int npts = (int)edgePoints.size();
+
+	fillPoly(img, &pts, &npts, 1, 255);
+	Mat filled = img(around);
+	erode(filled, filled, Mat());
+}
+
+/*
+	SHIFTIMAGE - Moves an image by whole pixels, in place
+	   Rows are copied in the order that never overwrites a row still to be
+	   read and the uncovered border is cleared, which is what an affine
+	   warp by an integer offset gives without the interpolation.
+	   Inputs - the image (or a region of one) and the offsets, positive
+	            to the right and down
+*/
+void shiftImage(Mat img, int dx, int dy)
+{
+	int H = img.rows;
+	int W = img.cols;
+	if (dx == 0 && dy == 0)
+		return;
+	if (abs(dx) >= W || abs(dy) >= H)
+	{
+		img.setTo(Scalar::all(0));
+		return;
+	}
+
+	size_t pixel = img.elemSize();
+	size_t span = (W - abs(dx)) * pixel;
+	size_t from = max(-dx, 0) * pixel;
+	size_t to = max(dx, 0) * pixel;
+	size_t cleared = dx > 0 ? 0 : span;
+	for (int i = 0; i < H; i++)
+	{
+		// moving down, start at the bottom so no row is overwritten before it is moved
+		int y = dy > 0 ? H - 1 - i : i;
+		uchar *dst = img.ptr<uchar>(y);
+		int source = y - dy;
+		if (source < 0 || source >= H)
+		{
+			memset(dst, 0, W * pixel);
+			continue;
+		}
+		memmove(dst + to, img.ptr<uchar>(source) + from, span);
+		memset(dst + cleared, 0, abs(dx) * pixel);
+	}
+}
+
+/*
+	CENTERIMAGE - Moves the edges and the frame so the edges sit in the middle
+	   The edges are only moved inside the region covering their box before
+	   and after the move, since everything else is already clear.
+	   Inputs - the color frame and its edges
+	   Return - how far everything moved, right and down
+*/
+Point centerImage(Mat &orignialImg, Mat &img)
+{
+	Rect box = edgeBounds(img);
+	if (box.area() == 0)
+		return Point(0, 0);
+
+	int rowshift = ((img.rows / 2) - ((box.height - 1) / 2)) - box.y;
+	int colshift = ((img.cols / 2) - ((box.width - 1) / 2)) - box.x;
+
+	Rect moved = box + Point(colshift, rowshift);
+	Rect region = (box | moved) & Rect(0, 0, img.cols, img.rows);
+	shiftImage(img(region), colshift, rowshift);
+
+	shiftImage(orignialImg, colshift, rowshift);
+
+	return Point(colshift, rowshift);
+}
+
+string sortColor(int &r, int &y, int &g, int &c, int &b, int &m)
+{
+	if (r > y && r > g && r > c && r > b && r > m)
+	{
+		if (r == 0)
+			return "none";
+		r = 0;
+		return "red";
+	}
+	if (y > r && y > g && y > c && y > b && y > m)
+	{
+		if (y == 0)
+			return "none";
+		y = 0;
+		return "yellow";
+	}
+	if (g > y && g > r && g > c && g > b && g > m)
+	{
+		if (g == 0)
+			return "none";
+		g = 0;
+		return "green";
+	}
+	if (c > y && c > g && c > r && c > b && c > m)
+	{
+		if (c == 0)
+			return "none";
+		c = 0;
+		return "cyan";
+	}
+	if (b > y && b > g && b > c && b > r && b > m)
+	{
+		if (b == 0)
+			return "none";
+		b = 0;
+		return "blue";
+	}
+	if (m > y && m > g && m > c && m > b && m > r)
+	{
+		if (m == 0)
+			return "none";
+		m = 0;
+		return "magenta";
+	}
+	// no single color has the most pixels
+	return "none";
+}
+
+// Named hues that getColors counts, HUE_NONE for a hue it does not count
+enum HueName { HUE_NONE, HUE_RED, HUE_YELLOW, HUE_GREEN, HUE_CYAN, HUE_BLUE, HUE_MAGENTA, HUE_NAMES };
+
+// Fixed point precision of the 8 bit HSV conversion, the same as OpenCV's
+const int HSV_SHIFT = 12;
+
+/*
+	HSVTABLES - Lookup tables for turning one BGR pixel into hue and saturation
+	   The divisions are those of cvtColor with CV_BGR2HSV on 8 bit images, so
+	   the results are the same. Filled in by the compiler.
+*/
+struct HsvTables
+{
+	int saturationScale[256];	// (255 << HSV_SHIFT) / value
+	int hueScale[256];			// (180 << HSV_SHIFT) / (6 * (value - minimum))
+	uchar bin[256];				// hue bin of the color histogram
+	uchar name[256];			// HueName of a hue
+};
+
+constexpr HsvTables makeHsvTables()
+{
+	HsvTables tables = {};
+	for (int i = 1; i < 256; i++)
+	{
+		// rounded like saturate_cast, none of these is exactly halfway
+		tables.saturationScale[i] = (int)((255 << HSV_SHIFT) / (1.0 * i) + 0.5);
+		tables.hueScale[i] = (int)((180 << HSV_SHIFT) / (6.0 * i) + 0.5);
+	}
+	for (int hue = 0; hue < 256; hue++)
+	{
+		tables.bin[hue] = (uchar)(hue < 180 ? hue * HUE_BINS / 180 : HUE_BINS - 1);
+		// a hue of 0 is mostly gray pixels, which have no hue to name
+		tables.name[hue] = (uchar)(hue == 0 ? HUE_NONE : hue <= 15 || hue > 165 ? HUE_RED : hue <= 45 ? HUE_YELLOW
+			: hue <= 75 ? HUE_GREEN : hue <= 105 ? HUE_CYAN : hue <= 135 ? HUE_BLUE : HUE_MAGENTA);
+	}
+	return tables;
+}
+
+constexpr HsvTables HSV_TABLES = makeHsvTables();
+
+/*
+	COLORSTATS - Color counts of the pixels of an object
+*/
+class ColorStats
+{
+public:
+	int bins[COLOR_BINS];	// pixels in each bin of the color histogram
+	int names[HUE_NAMES];	// pixels of each named hue
+	int pixels;
+
+	ColorStats()
+	{
+		fill(bins, bins + COLOR_BINS, 0);
+		fill(names, names + HUE_NAMES, 0);
+		pixels = 0;
+	}
+
+	void add(const ColorStats &other)
+	{
+		for (int i = 0; i < COLOR_BINS; i++)
+			bins[i] += other.bins[i];
+		for (int i = 0; i < HUE_NAMES; i++)
+			names[i] += other.names[i];
+		pixels += other.pixels;
+	}
+};
+
+// Counts the colors of the mask pixels of one row, converting only those to HSV
+void colorStatsRow(const uchar *bgr, const uchar *mask, int width, ColorStats &stats)
+{
+	for (int x = 0; x < width; x++)
+	{
+#ifdef IDENTIFIER_SSE2
+		// step over 16 pixels at a time outside the object
+		if ((x & 15) == 0 && x + 16 <= width
+			&& _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(mask + x)), _mm_setzero_si128())) == 0xffff)
+		{
+			x += 15;
+			continue;
+		}
+#endif
+		if (mask[x] == 0)
+			continue;
+
+		int b = bgr[3 * x], g = bgr[3 * x + 1], r = bgr[3 * x + 2];
+		int v = max(b, max(g, r));
+		int diff = v - min(b, min(g, r));
+		int vr = v == r ? -1 : 0;
+		int vg = v == g ? -1 : 0;
+		int saturation = (diff * HSV_TABLES.saturationScale[v] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+		int hue = (vr & (g - b)) + (~vr & ((vg & (b - r + 2 * diff)) + ((~vg) & (r - g + 4 * diff))));
+		hue = (hue * HSV_TABLES.hueScale[diff] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+		hue += hue < 0 ? 180 : 0;
+
+		stats.bins[HSV_TABLES.bin[hue] * SAT_BINS + saturation * SAT_BINS / 256]++;
+		stats.names[HSV_TABLES.name[hue]]++;
+		stats.pixels++;
+	}
+}
+
+/*
+	COLORSTATISTICS - Counts the colors of the object in bands of rows
+	   Inputs - BGR image, mask of the object, threads to use
+*/
+ColorStats colorStatistics(Mat &img, Mat &mask, ThreadPool *pool)
+{
+	ColorStats total;
+	mutex totalMutex;
+
+	parallelRows(pool, 0, mask.rows, 32, [&](int top, int bottom)
+	{
+		// each band counts on its own and adds its counts once at the end
+		ColorStats band;
+		for (int y = top; y < bottom; y++)
+			colorStatsRow(img.ptr<uchar>(y), mask.ptr<uchar>(y), mask.cols, band);
+		lock_guard<mutex> lock(totalMutex);
+		total.add(band);
+	});
+	return total;
+}
+
+Item getColors(Mat &img, Mat &edges, ThreadPool *pool = 0)
+{
+	ColorStats stats = colorStatistics(img, edges, pool);
+	int red = stats.names[HUE_RED];
+	int yellow = stats.names[HUE_YELLOW];
+	int green = stats.names[HUE_GREEN];
+	int cyan = stats.names[HUE_CYAN];
+	int blue = stats.names[HUE_BLUE];
+	int magenta = stats.names[HUE_MAGENTA];
+
+	string firstColor = sortColor(red,yellow,green,cyan,blue,magenta);
+	string secondColor = sortColor(red, yellow, green, cyan, blue, magenta);
+	string thirdColor = sortColor(red, yellow, green, cyan, blue, magenta);
+	
+	int nonZeros = countNonZero(edges);
+	
+	Item temp = Item(edges, firstColor, secondColor, thirdColor,nonZeros);
+	for (int i = 0; i < COLOR_BINS; i++)
+		temp.colors[i] = stats.pixels ? (float)stats.bins[i] / stats.pixels : 0;
+
+	return temp;
+}
+
+/*
+	LOCATEOBJECT - Finds the part of the frame the object is in on a smaller copy
+	   The frame is shrunk by averaging blocks of scale x scale pixels, then
+	   goes through the same filters and edge trace, which cost next to
+	   nothing at that size.
+	   Inputs - the frame, the workspace with the small buffers prepared for
+	            scale, the scale and the threads to use
+	   Return - the box of the small edges in frame pixels, grown to cover
+	            the filter windows at both sizes, empty if there are no edges
+*/
+Rect locateObject(Mat &img, PipelineWorkspace &workspace, int scale, ThreadPool *pool)
+{
+	resize(img, workspace.small, workspace.smallMag.size(), 0, 0, INTER_AREA);
+	fusedPreprocess(workspace.small, workspace.smallMag, workspace.smallAngle, pool);
+	clearBorderBand(workspace.smallMag, 1);
+	hysteresisTrace(workspace.smallMag, workspace.smallEdges, 150, 40, pool);
+
+	Rect box = edgeBounds(workspace.smallEdges);
+	if (box.area() == 0)
+		return Rect();
+
+	// a small edge can sit two small pixels from the one it came from, and
+	// the full size filters lose the outer few pixels of the region
+	int margin = 2 * scale + 4;
+	Rect region(box.x * scale - margin, box.y * scale - margin,
+		box.width * scale + 2 * margin, box.height * scale + 2 * margin);
+	return region & Rect(0, 0, img.cols, img.rows);
+}
+
+/*
+	DETECTEDGES - Runs the filters, edge trace and edge thinning on part of a frame
+	   Inputs - the frame, the workspace prepared for it, the part of the frame
+	            to work on and the pipeline settings
+	   The stages see views of the region, so the edges come out in frame
+	   position and nothing outside the region is read or written.
+*/
+void detectEdges(Mat &img, PipelineWorkspace &workspace, Rect region, const PipelineOptions &options)
+{
+	Mat frame = img(region);
+	Mat sobrelMag = workspace.mag(region);
+	Mat sobrelAngle = workspace.angle(region);
+	Mat edges = workspace.edges(region);
+	if (options.fused && options.medianRadius == 1)
+	{
+		// grayscale, blur and gradients in one pass without full size intermediates
+		StageTimer timer(STAGE_FUSED);
+		fusedPreprocess(frame, sobrelMag, sobrelAngle, options.pool);
+	}
+	else
+	{
+		Mat grayImage = workspace.gray(region);
+		{
+			StageTimer timer(STAGE_GRAYSCALE);
+			toGrayscale(frame, grayImage, options.pool);
+		}
+		Mat blur = workspace.blur(region);
+		//After changing to grayscale
+		if (options.showWindows)
+			imshow("Grayscale Image", grayImage);
+		// filter image to create blur
+		{
+			StageTimer timer(STAGE_MEDIAN);
+			medianFilter(grayImage, blur, options.medianRadius, options.pool);
+		}
+		//Sobrel Filter to find gradients
+		StageTimer timer(STAGE_SOBREL);
+		sobrelFilter(blur, sobrelMag, sobrelAngle, options.pool);
+	}
+	clearBorderBand(sobrelMag, max(options.medianRadius, 1));
+    // Trace the edge along gradients
+	{
+		StageTimer timer(STAGE_TRACE);
+		if (options.legacyEdges)
+		{
+			// the walks only mark edges, so last frame's must go first
+			edges.setTo(Scalar(0));
+			traceEdge(sobrelMag, sobrelAngle, edges, 150, 40);
+		}
+		else
+			hysteresisTrace(sobrelMag, edges, 150, 40, options.pool);
+	}
+	// Suppress edges to create thiner edge that follows smoother lines
+	{
+		StageTimer timer(STAGE_SUPPRESS);
+		if (options.legacyEdges)
+			edgeSuppression(edges, sobrelAngle);
+		else
+			nonMaxSuppression(edges, sobrelAngle, sobrelMag, options.pool);
+	}
+}
+
+Item imageProcessing(Mat img, PipelineWorkspace &workspace, const PipelineOptions &options = PipelineOptions())
+{
+	StageTimer frameTimer(STAGE_FRAME);
+	if (options.showWindows)
+		destroyAllWindows();
+	int scale = max(options.pyramidScale, 1);
+	workspace.prepare(img.size(), scale, !options.fused || options.medianRadius != 1);
+	Mat edges = workspace.edges;
+	//Before changing to grayscale
+	if (options.showWindows)
+		imshow("Orignal Image", img);			  
+
+	Rect frame(0, 0, img.cols, img.rows);
+	Rect region = frame;
+	if (scale > 1)
+	{
+		StageTimer timer(STAGE_LOCATE);
+		region = locateObject(img, workspace, scale, options.pool);
+		// only the region is filtered, so last frame's edges and shape must go
+		if (workspace.written.area() > 0)
+		{
+			workspace.edges(workspace.written).setTo(Scalar(0));
+			workspace.shape(workspace.written).setTo(Scalar(0));
+		}
+		workspace.written = Rect();
+	}
+	if (region.area() > 0)
+		detectEdges(img, workspace, region, options);
+	
+	Point shift;
+	{
+		StageTimer timer(STAGE_CENTER);
+		shift = centerImage(img,edges);
+	}
+	if (region.area() > 0)
+	{
+		// the edges are inside the region, moved by the shift
+		Rect moved = (region + shift) & frame;
+		int left = min(region.x, moved.x);
+		int top = min(region.y, moved.y);
+		workspace.written = Rect(left, top, max(region.x + region.width, moved.x + moved.width) - left,
+			max(region.y + region.height, moved.y + moved.height) - top);
+	}
+	{
+		StageTimer timer(STAGE_OUTLINE);
+		if (workspace.written.area() > 0)
+			outline(edges(workspace.written), workspace.shape(workspace.written), options.outlineTolerance);
+	}
+
+	if (options.showWindows)
+		waitKey(60);
+	StageTimer timer(STAGE_COLORS);
+	Item temp = getColors(img, workspace.shape, options.pool);
+
+	return temp;
+}
+
+// Runs the pipeline with buffers kept by the calling thread between frames
+Item imageProcessing(Mat img, const PipelineOptions &options = PipelineOptions())
+{
+	static thread_local PipelineWorkspace workspace;
+	return imageProcessing(img, workspace, options);
+}
+
+MotionDetector::MotionDetector()
+{
+	blockSize = 16;
+	blockThreshold = 12;
+	minChanged = 0.005;
+	settleFrames = 5;
+	stillFrames = 0;
+}
+
+bool MotionDetector::update(const Mat &frame)
+{
+	StageTimer timer(STAGE_MOTION);
+	// blocks are read as BGR bytes every fourth pixel, so they need whole samples
+	if (frame.type() != CV_8UC3 || blockSize < 4 || blockSize % 4 != 0 || frame.cols < blockSize || frame.rows < blockSize)
+		return false;
+	blockMeans(frame, current);
+	if (current.size() != previous.size())
+	{
+		// first frame, or a new frame size, nothing to compare with
+		current.swap(previous);
+		settledScene.clear();
+		stillFrames = 0;
+		return false;
+	}
+
+	bool moved = changed(current, previous);
+	current.swap(previous);
+	if (moved)
+	{
+		stillFrames = 0;
+		return false;
+	}
+	if (++stillFrames != settleFrames)
+		return false;
+
+	if (!settledScene.empty() && !changed(previous, settledScene))
+		return false;
+	settledScene = previous;
+	return true;
+}
+
+// Mean blue, green and red of every block, a row of blocks at a time
+void MotionDetector::blockMeans(const Mat &frame, vector<uchar> &means)
+{
+	int blocksX = frame.cols / blockSize;
+	int blocksY = frame.rows / blockSize;
+	int samples = (blockSize / 4) * (blockSize / 4);
+	vector<int> sums(3 * blocksX, 0);
+	means.resize(3 * blocksX * blocksY);
+
+	for (int by = 0; by < blocksY; by++)
+	{
+		fill(sums.begin(), sums.end(), 0);
+		for (int y = by * blockSize; y < (by + 1) * blockSize; y += 4)
+		{
+			const uchar *row = frame.ptr<uchar>(y);
+			for (int x = 0; x < blocksX * blockSize; x += 4)
+			{
+				int *sum = &sums[3 * (x / blockSize)];
+				sum[0] += row[3 * x];
+				sum[1] += row[3 * x + 1];
+				sum[2] += row[3 * x + 2];
+			}
+		}
+		for (int i = 0; i < 3 * blocksX; i++)
+			means[3 * by * blocksX + i] = (uchar)(sums[i] / samples);
+	}
+}
+
+// True when more than minChanged of the blocks differ between the two
+bool MotionDetector::changed(const vector<uchar> &a, const vector<uchar> &b)
+{
+	int count = 0;
+	for (size_t i = 0; i < a.size(); i += 3)
+		if (abs(a[i] - b[i]) > blockThreshold || abs(a[i + 1] - b[i + 1]) > blockThreshold
+			|| abs(a[i + 2] - b[i + 2]) > blockThreshold)
+			count++;
+	return count > minChanged * (a.size() / 3);
+}
+
+/*
+	SHAPEINDEX - Vantage point tree over the shape descriptors of the items
+	   Each node splits the items below it into those closer to its own item
+	   than its radius and those further away, so a nearest search can skip
+	   every branch that cannot hold anything closer than what it has found.
+*/
+class ShapeIndex
+{
+public:
+	void build(const vector<Item> &items)
+	{
+		points.resize(items.size() * DESCRIPTOR_SIZE);
+		for (size_t i = 0; i < items.size(); i++)
+			copy(items[i].descriptor, items[i].descriptor + DESCRIPTOR_SIZE, &points[i * DESCRIPTOR_SIZE]);
+
+		vector<int> order(items.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = (int)i;
+		nodes.clear();
+		nodes.reserve(items.size());
+		root = buildNode(order, 0, (int)order.size());
+	}
+
+	// Indexes of the k items accepted by the filter whose descriptors are
+	// closest to the query
+	vector<int> nearest(const float *query, int k, const function<bool(int)> &accept) const
+	{
+		priority_queue<pair<float, int> > best;		// furthest found so far on top
+		search(root, query, k, accept, best);
+
+		vector<int> found(best.size());
+		for (int i = (int)found.size() - 1; i >= 0; i--)
+		{
+			found[i] = best.top().second;
+			best.pop();
+		}
+		return found;
+	}
+
+private:
+	class Node
+	{
+	public:
+		int item;
+		float radius;
+		int inside;		// node of the items within radius, -1 if none
+		int outside;	// node of the items beyond it, -1 if none
+	};
+
+	float distance(const float *a, int item) const
+	{
+		const float *b = &points[item * DESCRIPTOR_SIZE];
+		float sum = 0;
+		for (int i = 0; i < DESCRIPTOR_SIZE; i++)
+			sum += (a[i] - b[i]) * (a[i] - b[i]);
+		return sqrt(sum);
+	}
+
+	// Builds the tree of order[begin, end) and returns its node
+	int buildNode(vector<int> &order, int begin, int end)
+	{
+		if (begin >= end)
+			return -1;
+
+		int index = (int)nodes.size();
+		nodes.push_back(Node());
+		nodes[index].item = order[begin];
+		nodes[index].radius = 0;
+
+		// split the rest at the median distance from the vantage point
+		const float *vantage = &points[order[begin] * DESCRIPTOR_SIZE];
+		int middle = (begin + 1 + end) / 2;
+		if (begin + 1 < end)
+		{
+			nth_element(order.begin() + begin + 1, order.begin() + middle, order.begin() + end,
+				[&](int a, int b) { return distance(vantage, a) < distance(vantage, b); });
+			nodes[index].radius = distance(vantage, order[middle]);
+		}
+		int inside = buildNode(order, begin + 1, middle);
+		int outside = buildNode(order, middle, end);
+		nodes[index].inside = inside;
+		nodes[index].outside = outside;
+		return index;
+	}
+
+	void search(int index, const float *query, int k, const function<bool(int)> &accept, priority_queue<pair<float, int> > &best) const
+	{
+		if (index < 0 || k <= 0)
+			return;
+
+		const Node &node = nodes[index];
+		float d = distance(query, node.item);
+		if (((int)best.size() < k || d < best.top().first) && accept(node.item))
+		{
+			best.push(make_pair(d, node.item));
+			if ((int)best.size() > k)
+				best.pop();
+		}
+
+		// the side the query is on first, the other only if it can still be closer
+		bool insideFirst = d < node.radius;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			bool inside = (pass == 0) == insideFirst;
+			float reach = (int)best.size() < k ? FLT_MAX : best.top().first;
+			if (inside && d - reach <= node.radius)
+				search(node.inside, query, k, accept, best);
+			else if (!inside && d + reach >= node.radius)
+				search(node.outside, query, k, accept, best);
+		}
+	}
+
+	vector<float> points;
+	vector<Node> nodes;
+	int root;
+};
+
+// Items whose color histograms are further apart than this have different colors
+const float COLOR_MATCH_DISTANCE = 0.5f;
+
+// Sums |a - b| over bins [i, COLOR_BINS) without vector instructions
+float colorDistanceScalar(const float *a, const float *b, int i)
+{
+	float sum = 0;
+	for (; i < COLOR_BINS; i++)
+		sum += fabs(a[i] - b[i]);
+	return sum;
+}
+
+#ifdef IDENTIFIER_SSE2
+// Sums |a - b| 4 bins at a time, returns how many bins it summed
+int colorDistanceSSE2(const float *a, const float *b, int bins, float &sum)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 total = _mm_setzero_ps();
+	int i = 0;
+	for (; i <= bins - 4; i += 4)
+		total = _mm_add_ps(total, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, total);
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	return i;
+}
+#endif
+
+#ifdef IDENTIFIER_AVX2
+// Sums |a - b| 8 bins at a time, returns how many bins it summed
+IDENTIFIER_TARGET_AVX2
+int colorDistanceAVX2(const float *a, const float *b, int bins, float &sum)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 total = _mm256_setzero_ps();
+	int i = 0;
+	for (; i <= bins - 8; i += 8)
+		total = _mm256_add_ps(total, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+
+	float lanes[8];
+	_mm256_storeu_ps(lanes, total);
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+	return i;
+}
+#endif
+
+/*
+	COLORDISTANCE - L1 distance between two color histograms
+	   Return - 0 for the same colors up to 2 for colors that do not overlap
+*/
+float colorDistance(const float *a, const float *b)
+{
+	float sum = 0;
+	int i = 0;
+#ifdef IDENTIFIER_AVX2
+	if (simdLevel() >= SIMD_AVX2)
+		i = colorDistanceAVX2(a, b, COLOR_BINS, sum);
+#endif
+#ifdef IDENTIFIER_SSE2
+	if (simdLevel() >= SIMD_SSE2)
+		i += colorDistanceSSE2(a + i, b + i, COLOR_BINS - i, sum);
+#endif
+	return sum + colorDistanceScalar(a, b, i);
+}
+
+/*
+	COLORINDEX - Lists the items under each of their dominant hues
+	   Items whose dominant hues are not near those of the query cannot have
+	   the same colors, so they are dropped without looking at them.
+*/
+class ColorIndex
+{
+public:
+	void build(const vector<Item> &items)
+	{
+		postings.assign(HUE_BINS + 1, vector<int>());
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			vector<int> hues = dominantHues(items[i].colors);
+			for (size_t h = 0; h < hues.size(); h++)
+				postings[hues[h]].push_back((int)i);
+		}
+	}
+
+	// Marks the items that share a dominant hue, or a neighbouring one, with the query
+	void compatible(const float *colors, vector<char> &marks) const
+	{
+		vector<int> hues = dominantHues(colors);
+		for (size_t h = 0; h < hues.size(); h++)
+		{
+			int hue = hues[h];
+			for (int step = -1; step <= 1; step++)
+			{
+				// the gray list has no neighbours, hues wrap around at red
+				if (hue == HUE_BINS && step != 0)
+					continue;
+				int bin = hue == HUE_BINS ? hue : (hue + step + HUE_BINS) % HUE_BINS;
+				const vector<int> &list = postings[bin];
+				for (size_t i = 0; i < list.size(); i++)
+					marks[list[i]] = 1;
+			}
+		}
+	}
+
+	/*
+		DOMINANTHUES - Hue bins that hold a large share of the pixels
+		   Return - one or two hue bins, where HUE_BINS stands for gray
+	*/
+	static vector<int> dominantHues(const float *colors)
+	{
+		float hue[HUE_BINS + 1] = { 0 };
+		for (int h = 0; h < HUE_BINS; h++)
+		{
+			// the lowest saturation bin is too gray to trust its hue
+			hue[HUE_BINS] += colors[h * SAT_BINS];
+			for (int s = 1; s < SAT_BINS; s++)
+				hue[h] += colors[h * SAT_BINS + s];
+		}
+
+		vector<int> hues;
+		int first = (int)(max_element(hue, hue + HUE_BINS + 1) - hue);
+		hues.push_back(first);
+		float share = hue[first];
+		hue[first] = 0;
+		int second = (int)(max_element(hue, hue + HUE_BINS + 1) - hue);
+		if (hue[second] >= 0.2f * (share + hue[second]))
+			hues.push_back(second);
+		return hues;
+	}
+
+private:
+	vector<vector<int> > postings;		// items by dominant hue, the last list is gray items
+};
+
+/*
+	ITEMCATALOG - Known items, kept in one binary file that is mapped into memory
+	   The file is a header followed by one record per item, each holding the
+	   name, colors, pixel count and packed shape mask. Opening only maps the
+	   file, the masks of loaded items point straight into the mapping. Added
+	   items are written after the last record and then counted in the
+	   header, so a half written record is never read back.
+*/
+const char CATALOG_MAGIC[8] = { 'I', 'D', 'C', 'A', 'T', 'L', 'G', 0 };
+const uint32_t CATALOG_VERSION = 5;		// 2 packed the masks, 3 added shape descriptors, 4 color histograms, 5 padded records to cache lines
+const int CATALOG_ALIGN = 64;		// records and masks start on cache lines
+
+struct CatalogHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint64_t itemCount;
+	uint64_t dataSize;			// bytes of records after the header
+	char reserved[32];
+};
+
+struct CatalogRecord
+{
+	uint32_t recordSize;		// record and packed mask, padded to CATALOG_ALIGN
+	int32_t rows;
+	int32_t cols;
+	int32_t nonZeros;
+	char name[64];
+	char firstColor[16];
+	char secondColor[16];
+	char thirdColor[16];
+	float descriptor[DESCRIPTOR_SIZE];
+	float colors[COLOR_BINS];
+	char reserved[32];			// pads the record so the mask after it starts on a cache line
+};
+
+static_assert(sizeof(CatalogRecord) % CATALOG_ALIGN == 0, "catalog masks must start on cache lines");
+
+class ItemCatalog
+{
+public:
+	vector<Item> items;
+	int candidateCount;		// items compared pixel by pixel per query, 0 compares all
+
+	ItemCatalog()
+	{
+		candidateCount = 32;
+		indexStale = true;
+		file = 0;
+		mapping = 0;
+		mappedSize = 0;
+#ifdef _WIN32
+		fileHandle = INVALID_HANDLE_VALUE;
+		mappingHandle = 0;
+#endif
+	}
+
+	~ItemCatalog()
+	{
+		// loaded items point into the mapping, so they go first
+		items.clear();
+		close();
+	}
+
+	/*
+		OPEN - Maps the catalog at path and loads its items
+		   Inputs - create makes an empty catalog if there is no file yet,
+		            error is set to why the file could not be used or read to the end
+		   Return - false if the file is missing, unreadable or of another version
+	*/
+	bool open(const string &path, bool create, string &error)
+	{
+		error.clear();
+		items.clear();
+		indexStale = true;
+		close();
+
+		file = fopen(path.c_str(), "r+b");
+		if (!file && create)
+		{
+			file = fopen(path.c_str(), "w+b");
+			if (file)
+			{
+				memset(&header, 0, sizeof(header));
+				memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+				header.version = CATALOG_VERSION;
+				header.headerSize = sizeof(CatalogHeader);
+				writeHeader();
+			}
+		}
+		if (!file)
+		{
+			error = "cannot open catalog " + path;
+			return false;
+		}
+
+		if (fseek(file, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CATALOG_MAGIC, sizeof(header.magic)) != 0)
+		{
+			error = path + " is not an item catalog";
+			close();
+			return false;
+		}
+		if (header.version != CATALOG_VERSION || header.headerSize != sizeof(CatalogHeader))
+		{
+			error = path + " is catalog version " + to_string(header.version) + ", expected " + to_string(CATALOG_VERSION);
+			close();
+			return false;
+		}
+		if (!map(path, sizeof(CatalogHeader) + header.dataSize))
+		{
+			error = "cannot map catalog " + path;
+			close();
+			return false;
+		}
+
+		items.reserve(header.itemCount);
+		uint64_t offset = sizeof(CatalogHeader);
+		for (uint64_t i = 0; i < header.itemCount; i++)
+		{
+			const CatalogRecord *record = (const CatalogRecord*)(mapping + offset);
+			if (offset + sizeof(CatalogRecord) > mappedSize || offset + record->recordSize > mappedSize
+				|| record->rows < 0 || record->cols < 0 || packedSize(record->rows, record->cols) + sizeof(CatalogRecord) > record->recordSize)
+			{
+				error = path + " is damaged after item " + to_string(i);
+				break;
+			}
+
+			// the mask is read only and lives as long as the mapping
+			Item item = Item(Mat(), field(record->firstColor, 16), field(record->secondColor, 16), field(record->thirdColor, 16), record->nonZeros);
+			item.bits = Mat(1, (int)packedSize(record->rows, record->cols), CV_8U, (void*)(record + 1));
+			item.maskSize = Size(record->cols, record->rows);
+			copy(record->descriptor, record->descriptor + DESCRIPTOR_SIZE, item.descriptor);
+			copy(record->colors, record->colors + COLOR_BINS, item.colors);
+			item.setname(field(record->name, 64));
+			items.push_back(item);
+			offset += record->recordSize;
+		}
+		return true;
 	}
-}
-
-void bottomSide(Mat edges, vector<Point> &edgePoints)
-{
-	vector<Point> tmpVec;
-	Point start = edgePoints.back();
 
-	for (int col = start.x ; col > 0; col--)
+	/*
+		APPEND - Adds an item, and writes it to the end of the file if one is open
+		   Inputs - error is set to why the item could not be written
+		   Return - false if the item could not be written
+	*/
+	bool append(Item item, string &error)
 	{
-		for (int row = edges.rows - 1; row >= (edges.rows / 2); row--)
+		error.clear();
+		// only the packed mask is kept, the shape belongs to a workspace
+		item.shape = Mat();
+		items.push_back(item);
+		indexStale = true;
+		if (!file)
+			return true;
+
+		if (item.name.size() >= 64)
 		{
-			if (edges.at<uchar>(row, col) == 255)
-			{		
-				Point tmp = edgePoints.back();
-
-				if ((abs(tmp.y - row) < 30))
-					tmpVec.push_back(Point(col, row));
+			error = "item names are limited to 63 characters, " + item.name + " is kept until exit only";
+			return false;
+		}
 
-				break;
-			}
+		CatalogRecord record;
+		memset(&record, 0, sizeof(record));
+		size_t maskSize = item.bits.total();
+		record.recordSize = (uint32_t)((sizeof(CatalogRecord) + maskSize + CATALOG_ALIGN - 1) / CATALOG_ALIGN * CATALOG_ALIGN);
+		record.rows = item.maskSize.height;
+		record.cols = item.maskSize.width;
+		record.nonZeros = item.nonZeros;
+		strncpy(record.name, item.name.c_str(), sizeof(record.name) - 1);
+		strncpy(record.firstColor, item.firstColor.c_str(), sizeof(record.firstColor) - 1);
+		strncpy(record.secondColor, item.secondColor.c_str(), sizeof(record.secondColor) - 1);
+		strncpy(record.thirdColor, item.thirdColor.c_str(), sizeof(record.thirdColor) - 1);
+		copy(item.descriptor, item.descriptor + DESCRIPTOR_SIZE, record.descriptor);
+		copy(item.colors, item.colors + COLOR_BINS, record.colors);
+
+		// write the record first and count it only once it is on disk
+		vector<char> padding(record.recordSize - sizeof(CatalogRecord) - maskSize, 0);
+		bool written = fseek(file, (long)(sizeof(CatalogHeader) + header.dataSize), SEEK_SET) == 0
+			&& fwrite(&record, sizeof(record), 1, file) == 1;
+		if (written && maskSize > 0)
+			written = fwrite(item.bits.ptr<uchar>(), maskSize, 1, file) == 1;
+		if (written && !padding.empty())
+			written = fwrite(&padding[0], padding.size(), 1, file) == 1;
+		if (!written || fflush(file) != 0)
+		{
+			error = "cannot write " + item.name + " to the catalog";
+			return false;
 		}
+
+		header.itemCount++;
+		header.dataSize += record.recordSize;
+		return writeHeader();
 	}
 
-	int size = tmpVec.size();
-	if (size != 0)
+	/*
+		CANDIDATES - Items whose shapes are worth comparing with the query
+		   Only items of the same colors are kept, found through the color
+		   index first and then checked with their full histograms. If more
+		   than candidateCount are left, the ones of the closest shape are used.
+	*/
+	vector<int> candidates(const Item &query)
 	{
-		int prev = tmpVec.at(0).x;
-		int i = 1;
-		int y;
-		edgePoints.push_back(tmpVec.at(0));
-		while (i < size)
+		// rebuilt on the first query after items were added
 		{
-			int tmpX = tmpVec.at(i).x;
-
-			if ((prev - tmpX) >= 10)
-			{
-				edgePoints.push_back(tmpVec.at(i));
-				prev = tmpX;
-				i++;
-			}
-			else
+			lock_guard<mutex> lock(indexMutex);
+			if (indexStale)
 			{
-				i++;
+				colorIndex.build(items);
+				if (candidateCount > 0 && (int)items.size() > candidateCount)
+					shapeIndex.build(items);
 			}
+			indexStale = false;
 		}
-		edgePoints.push_back(tmpVec.at(size - 1));
-	}
-}
 
-void leftSide(Mat edges, vector<Point> &edgePoints)
-{
-	vector<Point> tmpVec;
-	Point start = edgePoints.back();
+		vector<char> marks(items.size(), 0);
+		colorIndex.compatible(query.colors, marks);
+		function<bool(int)> sameColors = [&](int i)
+		{
+			return marks[i] && colorDistance(query.colors, items[i].colors) < COLOR_MATCH_DISTANCE;
+		};
 
-	for (int row = start.y; row > 0; row--)
-	{
-		for (int col = 0; col <= (edges.cols / 2); col++)
+		vector<int> found;
+		for (size_t i = 0; i < items.size() && (candidateCount <= 0 || (int)found.size() <= candidateCount); i++)
 		{
-			if (edges.at<uchar>(row, col) == 255)
-			{
-				Point tmp = edgePoints.back();
+			if (marks[i] && sameColors((int)i))
+				found.push_back((int)i);
+		}
+		if (candidateCount > 0 && (int)found.size() > candidateCount)
+			found = shapeIndex.nearest(query.descriptor, candidateCount, sameColors);
+		return found;
+	}
 
-				if ((abs(tmp.x- col) < 30) )
-					tmpVec.push_back(Point(col, row));
+private:
+	// Bytes that packMask makes for a mask of the given size
+	static uint64_t packedSize(int rows, int cols)
+	{
+		return ((uint64_t)rows * cols + 511) / 512 * 64;
+	}
 
-				break;
-			}
-		}
+	// Reads a string field that may fill its whole array without a terminator
+	static string field(const char *text, size_t size)
+	{
+		return string(text, strnlen(text, size));
 	}
 
-	int size = tmpVec.size();
-	
-	if (size != 0)
+	bool writeHeader()
 	{
-		int prev = tmpVec.at(0).y;
-		int i = 1;
-		int y;
-		edgePoints.push_back(tmpVec.at(0));
-		while (i < size)
-		{
-			int tmpX = tmpVec.at(i).y;
+		return fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && fflush(file) == 0;
+	}
 
-			if ((prev - tmpX) >= 10)
-			{
-				edgePoints.push_back(tmpVec.at(i));
-				prev = tmpX;
-				i++;
-			}
-			else
-			{
-				i++;
-			}
+	bool map(const string &path, uint64_t size)
+	{
+		mappedSize = size;
+#ifdef _WIN32
+		fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (fileHandle == INVALID_HANDLE_VALUE)
+			return false;
+		mappingHandle = CreateFileMappingA(fileHandle, 0, PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, 0);
+		if (!mappingHandle)
+			return false;
+		mapping = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+#else
+		int descriptor = ::open(path.c_str(), O_RDONLY);
+		if (descriptor < 0)
+			return false;
+		struct stat info;
+		void *view = MAP_FAILED;
+		if (fstat(descriptor, &info) == 0 && (uint64_t)info.st_size >= size)
+			view = mmap(0, size, PROT_READ, MAP_SHARED, descriptor, 0);
+		::close(descriptor);
+		mapping = view == MAP_FAILED ? 0 : (const char*)view;
+#endif
+		return mapping != 0;
 	}
-	edgePoints.push_back(tmpVec.at(size - 1));
+
+	void close()
+	{
+#ifdef _WIN32
+		if (mapping)
+			UnmapViewOfFile(mapping);
+		if (mappingHandle)
+			CloseHandle(mappingHandle);
+		if (fileHandle != INVALID_HANDLE_VALUE)
+			CloseHandle(fileHandle);
+		mappingHandle = 0;
+		fileHandle = INVALID_HANDLE_VALUE;
+#else
+		if (mapping)
+			munmap((void*)mapping, mappedSize);
+#endif
+		mapping = 0;
+		mappedSize = 0;
+		if (file)
+			fclose(file);
+		file = 0;
 	}
-}
 
-Mat outline(Mat &edges, int pTop)
-{
-	Mat img = Mat::zeros(edges.rows, edges.cols, CV_8U);
-	vector<Point> edgePoints = {};
-	
-	//get sides of shape
-	topSide(edges, edgePoints, pTop);
-	rightSide(edges, edgePoints);
-	bottomSide(edges, edgePoints);
-	leftSide(edges, edgePoints);
-	
-	const Point *pts = (const Point*) Mat(edgePoints).data;
-	int npts = Mat(edgePoints).rows;
+	ShapeIndex shapeIndex;
+	ColorIndex colorIndex;
+	bool indexStale;
+	mutex indexMutex;
+	FILE *file;
+	CatalogHeader header;
+	const char *mapping;
+	uint64_t mappedSize;
+#ifdef _WIN32
+	HANDLE fileHandle;
+	HANDLE mappingHandle;
+#endif
+};
 
-	polylines(img, &pts, &npts, 20, false, 255, 1, CV_AA, 0);
+// Pixel counts of two packed masks and of the pixels where they differ
+struct MaskCounts
+{
+	int differ;
+	int first;
+	int second;
+};
 
-	fillPoly(img, &pts, &npts, 1, 255);
+inline int popcount64(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
 
-	return img;
+// Counts words [i, words) of two packed masks without vector instructions
+void compareMasksScalar(const uint64_t *a, const uint64_t *b, int i, int words, MaskCounts &counts)
+{
+	for (; i < words; i++)
+	{
+		counts.differ += popcount64(a[i] ^ b[i]);
+		counts.first += popcount64(a[i]);
+		counts.second += popcount64(b[i]);
+	}
 }
 
-int centerImage(Mat &orignialImg, Mat &img)
+#ifdef IDENTIFIER_AVX2
+// Bits set in each of the 4 words, looked up 4 bits at a time and summed per word
+IDENTIFIER_TARGET_AVX2
+inline __m256i popcount4x64(__m256i v)
 {
-	//find highest Point
-	//find lowest Point
-	//find rightmost Point
-	//find leftmost point
-	int top, bottom, right, left;
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+		_mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+	return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
 
-	top = img.rows;
+IDENTIFIER_TARGET_AVX2
+inline int sum4x64(__m256i v)
+{
+	uint64_t sums[4];
+	_mm256_storeu_si256((__m256i*)sums, v);
+	return (int)(sums[0] + sums[1] + sums[2] + sums[3]);
+}
 
-	for (int col = 0; col < img.cols; col++)
+// Counts 4 words at a time, returns how many words it counted
+IDENTIFIER_TARGET_AVX2
+int compareMasksAVX2(const uint64_t *a, const uint64_t *b, int words, MaskCounts &counts)
+{
+	__m256i differ = _mm256_setzero_si256();
+	__m256i first = _mm256_setzero_si256();
+	__m256i second = _mm256_setzero_si256();
+	int i = 0;
+	for (; i <= words - 4; i += 4)
 	{
-		for (int row = 0; row < (img.rows / 2); row++)
-		{
-			if ((img.at<uchar>(row, col) == 255) && (row < top))
-				top = row;
-		}
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		differ = _mm256_add_epi64(differ, popcount4x64(_mm256_xor_si256(va, vb)));
+		first = _mm256_add_epi64(first, popcount4x64(va));
+		second = _mm256_add_epi64(second, popcount4x64(vb));
 	}
+	counts.differ += sum4x64(differ);
+	counts.first += sum4x64(first);
+	counts.second += sum4x64(second);
+	return i;
+}
+#endif
+
+#ifdef IDENTIFIER_AVX512
+// Adds the 8 words in scalar code like sum4x64, the reduce intrinsic warns under GCC -Wall
+IDENTIFIER_TARGET_AVX512
+inline int sum8x64(__m512i v)
+{
+	uint64_t sums[8];
+	_mm512_storeu_si512((void*)sums, v);
+	return (int)(sums[0] + sums[1] + sums[2] + sums[3] + sums[4] + sums[5] + sums[6] + sums[7]);
+}
 
-	right = 0;
-	for (int row = 0; row < img.rows; row++)
+// Counts 8 words at a time with VPOPCNTQ, returns how many words it counted
+IDENTIFIER_TARGET_AVX512
+int compareMasksAVX512(const uint64_t *a, const uint64_t *b, int words, MaskCounts &counts)
+{
+	__m512i differ = _mm512_setzero_si512();
+	__m512i first = _mm512_setzero_si512();
+	__m512i second = _mm512_setzero_si512();
+	int i = 0;
+	for (; i <= words - 8; i += 8)
 	{
-		for (int col = img.cols - 1; col > (img.cols / 2); col--)
-		{
-			if ((img.at<uchar>(row, col) == 255) && (col > right))
-				right = col;
-		}
+		__m512i va = _mm512_loadu_si512((const void*)(a + i));
+		__m512i vb = _mm512_loadu_si512((const void*)(b + i));
+		differ = _mm512_add_epi64(differ, _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+		first = _mm512_add_epi64(first, _mm512_popcnt_epi64(va));
+		second = _mm512_add_epi64(second, _mm512_popcnt_epi64(vb));
 	}
+	counts.differ += sum8x64(differ);
+	counts.first += sum8x64(first);
+	counts.second += sum8x64(second);
+	return i;
+}
+#endif
+
+/*
+	COMPAREMASKS - Compares two masks packed by packMask
+	   Inputs - the packed words of both masks and how many there are
+	   Return - pixels that differ and pixels set in each mask
+*/
+MaskCounts compareMasks(const uint64_t *a, const uint64_t *b, int words)
+{
+	MaskCounts counts = { 0, 0, 0 };
+	int i = 0;
+#ifdef IDENTIFIER_AVX512
+	if (simdLevel() >= SIMD_AVX512)
+		i = compareMasksAVX512(a, b, words, counts);
+#endif
+#ifdef IDENTIFIER_AVX2
+	if (simdLevel() >= SIMD_AVX2)
+		i += compareMasksAVX2(a + i, b + i, words - i, counts);
+#endif
+	compareMasksScalar(a, b, i, words, counts);
+	return counts;
+}
 
-	bottom = 0;
-	for (int col = img.cols - 1; col > 0; col--)
+/*
+	FINDMATCHES - Finds the items of the same colors and the closest shapes among the candidates
+	   Inputs - the item to identify, all known items, indexes of the ones to
+	            compare, how many matches to keep and the threads to use
+	   Return - up to k matches, closest shape first, ties in candidate order
+	   The candidates are scored on the pool and the best k kept in a heap,
+	   so a large catalog costs one pass instead of a search per pick. Only
+	   reads the items, so several images can be matched at once.
+*/
+vector<MatchResult> findMatches(Item &pItem, vector<Item> &items, const vector<int> &candidates, int k, ThreadPool *pool = 0)
+{
+	StageTimer timer(STAGE_COMPARE);
+	pipelineStats().count(COUNT_ITEMS_COMPARED, candidates.size());
+	vector<MatchResult> matches;
+	int count = (int)candidates.size();
+	if (count == 0 || k <= 0)
+		return matches;
+
+	const uint64_t *query = pItem.bits.ptr<uint64_t>();
+	int words = pItem.bits.cols / 8;
+	vector<int> difference(count);
+	vector<float> agreement(count);
+	function<void(int)> score = [&](int i)
 	{
-		for (int row = img.rows - 1; row > (img.rows / 2); row--)
+		Item &item = items.at(candidates[i]);
+		int diff = item.nonZeros * 1.5;
+		difference[i] = -1;
+
+		// colors are cheaper to compare than masks, and masks cannot differ
+		// in fewer pixels than their pixel counts do
+		float distance = colorDistance(pItem.colors, item.colors);
+		if (distance >= COLOR_MATCH_DISTANCE || item.maskSize != pItem.maskSize
+			|| abs(item.nonZeros - pItem.nonZeros) >= diff)
+			return;
+		int j = compareMasks(query, item.bits.ptr<uint64_t>(), words).differ;
+
+		if (j < diff)
 		{
-			if ((img.at<uchar>(row, col) == 255) && (row > bottom))
-				bottom = row;
+			difference[i] = j;
+			agreement[i] = 1 - distance / COLOR_MATCH_DISTANCE;
 		}
-	}
+	};
+	if (pool)
+		pool->parallelFor(count, score);
+	else
+		for (int i = 0; i < count; i++)
+			score(i);
 
-	left = img.cols;
-	for (int row = 0; row < (img.rows - 1); row++)
+	// the worst of the best k so far is on top, ready to be replaced
+	priority_queue<pair<int, int> > best;
+	for (int i = 0; i < count; i++)
 	{
-		for (int col = 0; col < (img.cols / 2); col++)
+		if (difference[i] == -1)
+			continue;
+		pair<int, int> key(difference[i], i);
+		if ((int)best.size() < k)
+			best.push(key);
+		else if (key < best.top())
 		{
-			if ((img.at<uchar>(row, col) == 255) && (col < left))
-				left = col;
+			best.pop();
+			best.push(key);
 		}
 	}
 
+	while (!best.empty())
+	{
+		int i = best.top().second;
+		best.pop();
+		matches.push_back(MatchResult(candidates[i], items[candidates[i]].getName(), difference[i], agreement[i]));
+	}
+	reverse(matches.begin(), matches.end());
+	return matches;
+}
 
-	int rowshift = ((img.rows / 2) - (abs(bottom - top) / 2)) - top;
-    int colshift = ((img.cols / 2) - (abs(right - left) / 2)) - left;
+// Finds the best match among the candidates, -1 if there is none
+int findMatch(Item &pItem, vector<Item> &items, const vector<int> &candidates)
+{
+	vector<MatchResult> matches = findMatches(pItem, items, candidates, 1);
+	return matches.empty() ? -1 : matches[0].index;
+}
 
-	translateImg(img, colshift, rowshift);
+// Compares the item with every known item
+int findMatch(Item &pItem, vector<Item> &items)
+{
+	vector<int> all(items.size());
+	for (size_t i = 0; i < all.size(); i++)
+		all[i] = (int)i;
+	return findMatch(pItem, items, all);
+}
 
-	translateImg(orignialImg, colshift, rowshift);
+// Compares the item only with the catalog items of the most similar shape
+int findMatch(Item &pItem, ItemCatalog &catalog)
+{
+	return findMatch(pItem, catalog.items, catalog.candidates(pItem));
+}
 
-	return top;	
+// Finds up to k matches among the catalog items of the most similar shape
+vector<MatchResult> findMatches(Item &pItem, ItemCatalog &catalog, int k, ThreadPool *pool = 0)
+{
+	return findMatches(pItem, catalog.items, catalog.candidates(pItem), k, pool);
 }
 
-string sortColor(int &r, int &y, int &g, int &c, int &b, int &m)
+/*
+	SYNTHETICSCENE - Makes a repeatable frame for the benchmark
+	   Inputs - Frame size, number of small shapes scattered around (sets how
+	   many edges there are), strength of the pixel noise and the random seed
+	   Return - Colored image with one large object in the middle of the frame
+*/
+Mat syntheticScene(Size size, int shapes, int noise, unsigned seed)
 {
-	if (r > y && r > g && r > c && r > b && r > m)
+	RNG rng(seed);
+	Mat scene(size, CV_8UC3, Scalar(70, 70, 70));
+	int scale = min(size.width, size.height);
+
+	for (int i = 0; i < shapes; i++)
 	{
-		if (r == 0)
-			return "none";
-		r = 0;
-		return "red";
+		Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+		int radius = rng.uniform(scale / 60 + 1, scale / 20 + 2);
+		if (i % 2)
+			circle(scene, center, radius, color, -1);
+		else
+			rectangle(scene, Rect(center.x, center.y, 2 * radius, radius), color, -1);
 	}
-	if (y > r && y > g && y > c && y > b && y > m)
+
+	// the object to identify, inside the guide rectangle of getPicture
+	circle(scene, Point(size.width / 2, size.height / 2), scale / 4, Scalar(200, 60, 30), -1);
+	rectangle(scene, Rect(size.width / 2 - scale / 8, size.height / 2 - scale / 8, scale / 4, scale / 4), Scalar(30, 200, 220), -1);
+
+	for (int y = 0; y < size.height && noise > 0; y++)
 	{
-		if (y == 0)
-			return "none";
-		y = 0;
-		return "yellow";
+		uchar *row = scene.ptr<uchar>(y);
+		for (int x = 0; x < 3 * size.width; x++)
+			row[x] = saturate_cast<uchar>(row[x] + rng.uniform(-noise, noise + 1));
 	}
-	if (g > y && g > r && g > c && g > b && g > m)
+	return scene;
+}
+
+// Times repeats runs of stage in milliseconds. prepare runs before every
+// run and is not timed. Returns no times if the stage failed.
+vector<double> timeStage(int repeats, const function<void()> &prepare, const function<void()> &stage)
+{
+	vector<double> times;
+	try
 	{
-		if (g == 0)
-			return "none";
-		g = 0;
-		return "green";
+		for (int i = 0; i < repeats; i++)
+		{
+			prepare();
+			int64 start = getTickCount();
+			stage();
+			times.push_back((getTickCount() - start) * 1000.0 / getTickFrequency());
+		}
 	}
-	if (c > y && c > g && c > r && c > b && c > m)
+	catch (const exception &)
 	{
-		if (c == 0)
-			return "none";
-		c = 0;
-		return "cyan";
+		times.clear();
 	}
-	if (b > y && b > g && b > c && b > r && b > m)
+	return times;
+}
+
+void printStageTimes(const string &stage, const vector<double> &times, double megapixels)
+{
+	if (times.empty())
 	{
-		if (b == 0)
-			return "none";
-		b = 0;
-		return "blue";
+		printf("  %-10s failed\n", stage.c_str());
+		return;
 	}
-	if (m > y && m > g && m > c && m > b && m > r)
+
+	double sum = 0, sumSquares = 0, fastest = times[0];
+	for (size_t i = 0; i < times.size(); i++)
 	{
-		if (m == 0)
-			return "none";
-		m = 0;
-		return "magenta";
+		sum += times[i];
+		sumSquares += times[i] * times[i];
+		fastest = min(fastest, times[i]);
 	}
+	double mean = sum / times.size();
+	double deviation = sqrt(max(sumSquares / times.size() - mean * mean, 0.0));
+
+	printf("  %-10s %9.3f ms  +/- %7.3f  min %9.3f  %9.1f MP/s\n", stage.c_str(), mean, deviation, fastest, megapixels / (mean / 1000.0));
 }
 
-Item getColors(Mat &img, Mat &edges)
+/*
+	CHECKPIPELINE - Runs the pipeline on frames whose answer is known
+	   Inputs - the pool for the parallel stages
+	   A uniform frame of any brightness must give no edges and no object,
+	   with the fused stages, with separate ones and with the walked edges,
+	   and pyramid mode must
+	   find a small region around an object on any background.
+	   Return - the number of checks that failed, each one is printed
+*/
+int checkPipeline(ThreadPool &pool)
 {
-	int red = 0;
-	int yellow = 0;
-	int green = 0;
-	int cyan = 0;
-	int blue = 0;
-	int magenta = 0;
-	Mat hsv;
-	cvtColor(img, hsv, CV_BGR2HSV);
-	for (int row = 0; row < edges.rows - 1; row++)
+	int failed = 0;
+	int backgrounds[] = { 0, 40, 70, 200, 255 };
+	for (int b = 0; b < 5; b++)
 	{
-		for (int col = 0; col < edges.cols - 1; col++)
+		for (int mode = 0; mode < 3; mode++)
 		{
-			if (edges.at<uchar>(row, col) == 255)
+			Mat img(240, 320, CV_8UC3, Scalar::all(backgrounds[b]));
+			PipelineOptions options;
+			options.pool = &pool;
+			options.showWindows = false;
+			options.medianRadius = mode == 1 ? 2 : 1;
+			options.legacyEdges = mode == 2;
+			PipelineWorkspace workspace;
+			Item item = imageProcessing(img, workspace, options);
+			int edges = countNonZero(workspace.edges);
+			if (edges != 0 || item.nonZeros != 0)
 			{
-				
-				Vec3b color = hsv.at<Vec3b>(row, col);
-				int hue = color[0];
-				
-				if (hue == 0)
-					break;
-				if (hue <= 15 || hue > 165)	
-					red++;
-				else if (hue > 15 && hue <= 45)
-					yellow++;
-				else if (hue > 45 && hue <= 75)
-					green++;
-				else if (hue > 75 && hue <= 105)
-					cyan++;
-				else if	(hue > 105 && hue <= 135)
-					blue++;
-				else if	(hue > 135 && hue <= 165)
-					magenta++;
+				printf("check failed: uniform %d gray frame, median radius %d, %s edges, gives %d edge pixels and %d object pixels\n",
+					backgrounds[b], options.medianRadius, options.legacyEdges ? "walk" : "hysteresis", edges, item.nonZeros);
+				failed++;
 			}
-
 		}
 	}
 
-	string firstColor = sortColor(red,yellow,green,cyan,blue,magenta);
-	string secondColor = sortColor(red, yellow, green, cyan, blue, magenta);
-	string thirdColor = sortColor(red, yellow, green, cyan, blue, magenta);
-	
-	int nonZeros = countNonZero(edges);
-	
-	Item temp = Item(edges, firstColor, secondColor, thirdColor,nonZeros);
-
-	return temp;
+	// pyramid mode only saves time if the region shrinks around the object
+	int objectBackgrounds[] = { 20, 35, 70, 150 };
+	for (int b = 0; b < 4; b++)
+	{
+		int gray = objectBackgrounds[b];
+		Mat img(480, 640, CV_8UC3, Scalar::all(gray));
+		Rect object(160, 110, 80, 80);
+		circle(img, Point(200, 150), 40, Scalar::all(gray < 128 ? 230 : 20), -1);
+		PipelineWorkspace workspace;
+		workspace.prepare(img.size(), 4);
+		Rect region = locateObject(img, workspace, 4, &pool);
+		if ((region & object) != object || region.area() > img.size().area() / 4)
+		{
+			printf("check failed: pyramid region on a %d gray frame is %d,%d %dx%d, expected about %d,%d %dx%d\n",
+				gray, region.x, region.y, region.width, region.height, object.x, object.y, object.width, object.height);
+			failed++;
+		}
+	}
+	return failed;
 }
 
-Item imageProcessing(Mat img)
+/*
+	RUNBENCHMARK - Times every pipeline stage on its own and the whole pipeline
+	   Inputs - Number of timed runs per stage and the pool for the parallel stages
+	   Uses a clean and a busy synthetic scene at 640x480, 1080p and 4K and
+	   prints the mean, deviation and fastest time of each stage with its
+	   throughput in megapixels per second. Checks the pipeline on frames
+	   with a known answer first.
+	   Return - 0, or 1 if a check failed
+*/
+int runBenchmark(int repeats, ThreadPool &pool)
 {
-	destroyAllWindows();
-	Mat grayImage = Mat::zeros(img.size(), CV_8U);;
-	Mat blur = Mat::zeros(img.size(), CV_8U);
-	Mat sobrelMag = Mat::zeros(img.size(), CV_8U);
-	Mat sobrelAngle = Mat::zeros(img.size(), CV_8U);
-	Mat edges = Mat::zeros(img.size(), CV_8U);
-	Mat shape = Mat::zeros(img.size(), CV_8U);
-	vector<Point> edgePoints;
-	//Before changing to grayscale
-	imshow("Orignal Image", img);			  
-	grayImage = toGrayscale(img);
-	//After changing to grayscale
-	imshow("Grayscale Image", grayImage);
-	// filter image to create blur
-	medianFilter(grayImage, blur);
-	//Sobrel Filter to find gradients
-	sobrelFilter(blur, sobrelMag, sobrelAngle);
-    // Trace the edge along gradients
-	traceEdge(sobrelMag, sobrelAngle, edges, 150, 40);
-	// Suppress edges to create thiner edge that follows smoother lines
-	edgeSuppression(edges, sobrelAngle, sobrelMag);
-	
-	int top = centerImage(img,edges);
-	shape = outline(edges, top);
+	Size sizes[] = { Size(640, 480), Size(1920, 1080), Size(3840, 2160) };
+	const char *sceneNames[] = { "clean", "busy" };
+	int sceneShapes[] = { 4, 60 };
+	int sceneNoise[] = { 2, 12 };
+	function<void()> nothing = [] {};
 
-	waitKey(60);
-	Item temp = getColors(img,shape);
-
-	return temp;
-}
+	PipelineOptions options;
+	options.pool = &pool;
+	options.showWindows = false;
 
-Mat getPicture()
-{
-	VideoCapture videoStream(2);   //0 is the id of video device.0 if you have only one camera.
-	
+	printf("%d threads, %d runs per stage\n", pool.size(), repeats);
+	if (checkPipeline(pool) > 0)
+		return 1;
 
-	if (!videoStream.isOpened()) { //check if video device has been initialised
-		cout << "cannot open camera";
-	}
-	Mat displayImage = Mat(Size(480, 640), CV_8UC3);;
-	//unconditional loop
-	while (true)
+	for (int s = 0; s < 3; s++)
 	{
-		Mat cameraFrame = Mat(Size(480, 640), CV_8UC3);
-		videoStream.read(cameraFrame);
-		cameraFrame.copyTo(displayImage);
-		rectangle(displayImage, Point(20, 20), Point(620, 460), Scalar(0, 255, 0),3);
-		circle(displayImage, Point(320, 240),3,Scalar(0,255,0),3);
-		
-		imshow("Camera", displayImage);
-		moveWindow("Camera", 0, 0);
-		if (waitKey(1) == 27)
-		{
-			videoStream.release();
-			destroyAllWindows();
-			return cameraFrame;
+		Size size = sizes[s];
+		double megapixels = size.area() / 1e6;
 
+		// catalog of circles of different sizes to match against
+		vector<Item> catalog;
+		for (int i = 0; i < 64; i++)
+		{
+			Mat mask = Mat::zeros(size, CV_8U);
+			circle(mask, Point(size.width / 2, size.height / 2), min(size.width, size.height) * (8 + i % 32) / 100, Scalar(255), -1);
+			Item item = Item(mask, "blue", "yellow", "none", countNonZero(mask));
+			item.setname("part" + to_string(i));
+			catalog.push_back(item);
 		}
 
+		for (int scene = 0; scene < 2; scene++)
+		{
+			printf("%dx%d %s\n", size.width, size.height, sceneNames[scene]);
+			Mat img = syntheticScene(size, sceneShapes[scene], sceneNoise[scene], 1234 + s);
+
+			// stage inputs, each made by the stage before
+			Mat gray = Mat::zeros(size, CV_8U);
+			toGrayscale(img, gray, &pool);
+			Mat blur = Mat::zeros(size, CV_8U);
+			Mat mag = Mat::zeros(size, CV_8U);
+			Mat angle = Mat::zeros(size, CV_8U);
+			Mat edges = Mat::zeros(size, CV_8U);
+			medianFilter(gray, blur, 1, &pool);
+			sobrelFilter(blur, mag, angle, &pool);
+			clearBorderBand(mag, 1);
+			hysteresisTrace(mag, edges, 150, 40, &pool);
+			Mat thin = edges.clone();
+			nonMaxSuppression(thin, angle, mag, &pool);
+			Mat centeredImg = img.clone();
+			Mat centeredEdges = thin.clone();
+			centerImage(centeredImg, centeredEdges);
+
+			Mat outMag = Mat::zeros(size, CV_8U);
+			Mat outAngle = Mat::zeros(size, CV_8U);
+			Mat work = Mat::zeros(size, CV_8U);
+			Mat workImg;
+			Mat shape = Mat::zeros(size, CV_8U);
+			PipelineWorkspace workspace;
+
+			printStageTimes("grayscale", timeStage(repeats, nothing, [&] { toGrayscale(img, work, &pool); }), megapixels);
+			printStageTimes("median", timeStage(repeats, nothing, [&] { medianFilter(gray, work, 1, &pool); }), megapixels);
+			printStageTimes("median r2", timeStage(repeats, nothing, [&] { medianFilter(gray, work, 2, &pool); }), megapixels);
+			printStageTimes("median r4", timeStage(repeats, nothing, [&] { medianFilter(gray, work, 4, &pool); }), megapixels);
+			printStageTimes("sobrel", timeStage(repeats, nothing, [&] { sobrelFilter(blur, outMag, outAngle, &pool); }), megapixels);
+			printStageTimes("fused", timeStage(repeats, nothing, [&] { fusedPreprocess(img, outMag, outAngle, &pool); }), megapixels);
+			printStageTimes("trace", timeStage(repeats, nothing, [&] { hysteresisTrace(mag, work, 150, 40, &pool); }), megapixels);
+			printStageTimes("suppress", timeStage(repeats, [&] { edges.copyTo(work); },
+				[&] { nonMaxSuppression(work, angle, mag, &pool); }), megapixels);
+			printStageTimes("walk trace", timeStage(repeats, [&] { work.setTo(Scalar(0)); },
+				[&] { traceEdge(mag, angle, work, 150, 40); }), megapixels);
+			printStageTimes("walk thin", timeStage(repeats, [&] { edges.copyTo(work); },
+				[&] { edgeSuppression(work, angle); }), megapixels);
+			printStageTimes("center", timeStage(repeats, [&] { thin.copyTo(work); img.copyTo(workImg); },
+				[&] { centerImage(workImg, work); }), megapixels);
+			vector<double> outlineTimes = timeStage(repeats, nothing, [&] { outline(centeredEdges, shape, options.outlineTolerance); });
+			printStageTimes("outline", outlineTimes, megapixels);
+			if (outlineTimes.empty())
+				continue;
+
+			Item item = getColors(centeredImg, shape, &pool);
+			// same colors everywhere, so every catalog shape gets compared
+			for (size_t i = 0; i < catalog.size(); i++)
+				copy(item.colors, item.colors + COLOR_BINS, catalog[i].colors);
+			printStageTimes("colors", timeStage(repeats, nothing, [&] { getColors(centeredImg, shape, &pool); }), megapixels);
+			printStageTimes("compare", timeStage(repeats, nothing, [&] { findMatch(item, catalog); }), megapixels);
+			vector<int> everything(catalog.size());
+			for (size_t i = 0; i < everything.size(); i++)
+				everything[i] = (int)i;
+			printStageTimes("top 5", timeStage(repeats, nothing, [&] { findMatches(item, catalog, everything, 5, &pool); }), megapixels);
+			printStageTimes("pipeline", timeStage(repeats, [&] { img.copyTo(workImg); },
+				[&] { imageProcessing(workImg, workspace, options); }), megapixels);
+			PipelineOptions pyramid = options;
+			pyramid.pyramidScale = 4;
+			printStageTimes("pyramid", timeStage(repeats, [&] { img.copyTo(workImg); },
+				[&] { imageProcessing(workImg, workspace, pyramid); }), megapixels);
+		}
 	}
+	return 0;
 }
 
-void addItem(Item tmp, vector<Item> &items)
+int runBenchmark(int repeats, int threads)
 {
-	char answer;
-	string name;
+	if (threads <= 0)
+		threads = thread::hardware_concurrency();
+	ThreadPool pool(max(threads, 1) - 1);
+	return runBenchmark(repeats, pool);
+}
 
-	cout << "Would you like to add this item? (y/n)";
-	
-	cin >> answer;
-	cin.ignore();
+/*
+	IDENTIFIER::IMPL - The pool, catalog and settings behind an Identifier
+	   Matching only reads the catalog, so identify holds the catalog lock
+	   shared and enroll holds it alone while it appends.
+*/
+class Identifier::Impl
+{
+public:
+	IdentifierSettings settings;
+	ThreadPool pool;
+	ItemCatalog catalog;
+	shared_timed_mutex catalogMutex;
 
-	while(answer != 'y' && answer != 'n')
+	Impl(const IdentifierSettings &pSettings) : pool(max(pSettings.threads, 1) - 1)
 	{
-		cin.clear();
-		cin >> answer;
-	    cin.ignore();
+		settings = pSettings;
+		catalog.candidateCount = settings.candidates;
 	}
 
-	if (answer == 'y')
+	// Runs the pipeline on a copy of the frame, since it moves the object
+	// to the middle of the image it is given
+	Item process(const Mat &frame, Mat &work, PipelineWorkspace &workspace, ThreadPool *stagePool)
 	{
-		cout << "What is the name of the Item? (No spaces) ";
-		cin >> name;
-		cin.ignore();
-		tmp.setname(name);
-		items.push_back(tmp);
-		cout << name << " was added." << endl;
+		frame.copyTo(work);
+
+		PipelineOptions options;
+		options.pool = stagePool;
+		options.showWindows = settings.showWindows;
+		options.pyramidScale = settings.pyramidScale;
+		options.medianRadius = settings.medianRadius;
+		options.legacyEdges = settings.legacyEdges;
+		options.outlineTolerance = settings.outlineTolerance;
+		return imageProcessing(work, workspace, options);
 	}
-	else if (answer == 'n')
-		return;
-}
 
-int compareDiff(vector<int> &pDiff)
-{
-	int index = 0;
-	int low = 50000;
+	// The frame copy and workspace the calling thread keeps between frames,
+	// one pair for everything it identifies and enrolls
+	class ThreadBuffers
+	{
+	public:
+		Mat work;
+		PipelineWorkspace workspace;
+	};
 
-	for (int i = 0; i < pDiff.size(); i++)
+	static ThreadBuffers &threadBuffers()
 	{
-		if ((low > pDiff.at(i)) && pDiff.at(i) != -1)
-		{
-			low = pDiff.at(i);
-			index = i;
-		}
+		static thread_local ThreadBuffers buffers;
+		return buffers;
 	}
 
-	if (pDiff.at(index) == -1)
-		return -1;
-	pDiff.at(index) = -1;
-
-	return index;
-}
-
-void compareItems(Item &pItem, vector<Item> &items)
-{
-	Mat dst;
-	vector<int> difference;
-	
-	if (items.size() == 0)
+	// Runs the pipeline with the buffers of the calling thread
+	Item process(const Mat &frame, ThreadPool *stagePool)
 	{
-		addItem(pItem, items);
-		return;
+		ThreadBuffers &buffers = threadBuffers();
+		return process(frame, buffers.work, buffers.workspace, stagePool);
 	}
 
-	int diff = pItem.nonZeros * 1.75;
-	for (int i = 0; i < items.size(); i++)
+	IdentifyResult identify(const Mat &frame, ThreadPool *stagePool)
 	{
-		int diff = items.at(i).nonZeros * 1.5;
-					  
-		compare(pItem.shape, items.at(i).shape, dst, CMP_NE);
-		int j = countNonZero(dst);
+		ThreadBuffers &buffers = threadBuffers();
+		return identify(frame, buffers.work, buffers.workspace, stagePool);
+	}
 
-	  
-		if (j < diff)
+	IdentifyResult identify(const Mat &frame, Mat &work, PipelineWorkspace &workspace, ThreadPool *stagePool)
+	{
+		IdentifyResult result;
+		if (frame.empty() || frame.type() != CV_8UC3)
 		{
-			cout << "diff added" << endl;
-			difference.push_back(j);
+			result.error = "expected a BGR frame";
+			return result;
 		}
-		else
-			difference.push_back(-1);
-	}
 
-	int j;
-    while(true)
-	{	
+		try
+		{
+			Item item = process(frame, work, workspace, stagePool);
+			result.shapePixels = item.nonZeros;
+			result.colors[0] = item.firstColor;
+			result.colors[1] = item.secondColor;
+			result.colors[2] = item.thirdColor;
+			if (item.nonZeros == 0)
+				return result;
+
+			shared_lock<shared_timed_mutex> lock(catalogMutex);
+			result.matches = findMatches(item, catalog, settings.matchCount, stagePool);
+		}
+		catch (const exception &e)
+		{
+			result.error = e.what();
+			return result;
+		}
 
-		j = compareDiff(difference);
-		if (j == -1)
-			break;
-			
-		if (pItem.firstColor == items.at(j).firstColor)
+		if (!result.matches.empty())
 		{
-			if (pItem.secondColor == items.at(j).secondColor)
-			{			
-				cout << " This item is " << items.at(j).getName() << endl;			
-				return;			
-			}			
+			result.found = true;
+			result.name = result.matches[0].name;
 		}
+		return result;
 	}
-	addItem(pItem, items);
+};
+
+Identifier::Identifier(const IdentifierSettings &settings)
+{
+	IdentifierSettings resolved = settings;
+	if (resolved.threads <= 0)
+		resolved.threads = thread::hardware_concurrency();
+	resolved.medianRadius = max(resolved.medianRadius, 1);
+	// the pyramid only has levels for 4 and 8, anything else filters the whole frame
+	if (resolved.pyramidScale != 4 && resolved.pyramidScale != 8)
+		resolved.pyramidScale = 1;
+	impl.reset(new Impl(resolved));
 }
 
-/** @function main */
-int main(int argc, char** argv)
+Identifier::~Identifier()
 {
-	vector<Item> items;
-	
-	char input = 'c';
+}
+
+OpenResult Identifier::open(const string &catalogPath, bool create)
+{
+	OpenResult result;
+	unique_lock<shared_timed_mutex> lock(impl->catalogMutex);
+	result.opened = impl->catalog.open(catalogPath, create, result.error);
+	result.items = (int)impl->catalog.items.size();
+	return result;
+}
+
+IdentifyResult Identifier::identify(const Mat &frame)
+{
+	return impl->identify(frame, &impl->pool);
+}
+
+vector<IdentifyResult> Identifier::identifyAll(int count, const function<Mat(int)> &frame)
+{
+	vector<IdentifyResult> results(max(count, 0));
+	// one frame per thread, each running the whole pipeline on its own
+	impl->pool.parallelFor(count, [&](int i)
+	{
+		results[i] = impl->identify(frame(i), 0);
+	});
+	return results;
+}
 
-	while (input != 'q')
+EnrollResult Identifier::enroll(const Mat &frame, const string &name)
+{
+	EnrollResult result;
+	if (frame.empty() || frame.type() != CV_8UC3)
+	{
+		result.error = "expected a BGR frame";
+		return result;
+	}
+
+	try
 	{
-		Mat img = Mat(Size(480, 640), CV_8UC3);
-		if (input == 'c')
+		Item item = impl->process(frame, &impl->pool);
+		if (item.nonZeros == 0)
 		{
-			img = getPicture();
+			result.error = "no object in the frame";
+			return result;
 		}
-		Item tmp = imageProcessing(img);
+		item.setname(name);
+
+		unique_lock<shared_timed_mutex> lock(impl->catalogMutex);
+		result.saved = impl->catalog.append(item, result.error);
+		result.index = (int)impl->catalog.items.size() - 1;
+	}
+	catch (const exception &e)
+	{
+		result.error = e.what();
+	}
+	return result;
+}
+
+int Identifier::size()
+{
+	shared_lock<shared_timed_mutex> lock(impl->catalogMutex);
+	return (int)impl->catalog.items.size();
+}
+
+int Identifier::threads() const
+{
+	return impl->pool.size();
+}
+
+void Identifier::writeStats(ostream &out)
+{
+	pipelineStats().writeJson(out);
+}
 
-		compareItems(tmp, items);
-		
-		cout << "If you wish to take another picture press (c). If you wish to quit press (q) ";
-		cin >> input;
-		cin.ignore();
+/*
+	IDENTIFIERSTREAM::IMPL - The buffers and stage threads of one stream
+*/
+class IdentifierStream::Impl
+{
+public:
+	Identifier::Impl &owner;
+	ThreadPool pool;
+	PipelineWorkspace workspace;
+	Mat work;
 
+	Impl(Identifier::Impl &pOwner, int threads) : owner(pOwner), pool(threads - 1)
+	{
 	}
-	
-	 
-	return 0;
+};
+
+IdentifierStream::IdentifierStream(Impl *pImpl)
+{
+	impl.reset(pImpl);
+}
+
+IdentifierStream::~IdentifierStream()
+{
+}
+
+IdentifyResult IdentifierStream::identify(const Mat &frame)
+{
+	return impl->owner.identify(frame, impl->work, impl->workspace, &impl->pool);
+}
+
+int IdentifierStream::threads() const
+{
+	return impl->pool.size();
+}
+
+unique_ptr<IdentifierStream> Identifier::openStream(int threads)
+{
+	return unique_ptr<IdentifierStream>(new IdentifierStream(new IdentifierStream::Impl(*impl, max(threads, 1))));
 }
@@ -0,0 +1,229 @@
+/**
+* identifier.h
+* Identifies objects in camera frames against a catalog of known items
+*/
+
+#ifndef IDENTIFIER_H
+#define IDENTIFIER_H
+
+#include "opencv2/core/core.hpp"
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+	MATCHRESULT - A catalog item that matches an identified item
+*/
+class MatchResult
+{
+public:
+	int index;			// position of the item in the catalog
+	std::string name;
+	int shapeDistance;	// pixels where the two shapes differ
+	float colorAgreement;	// 1 for the same colors, down to 0 at the color match limit
+
+	MatchResult(int pIndex, const std::string &pName, int pShapeDistance, float pColorAgreement)
+	{
+		index = pIndex;
+		name = pName;
+		shapeDistance = pShapeDistance;
+		colorAgreement = pColorAgreement;
+	}
+};
+
+/*
+	IDENTIFYRESULT - What was found in one frame
+*/
+class IdentifyResult
+{
+public:
+	bool found;			// an item of the catalog matched
+	std::string name;	// name of the best match, empty if none did
+	std::vector<MatchResult> matches;	// closest first
+	int shapePixels;	// size of the object, 0 if the frame has none
+	std::string colors[3];	// the most common colors of the object, most common first
+	std::string error;	// why the frame could not be processed, empty if it was
+
+	IdentifyResult()
+	{
+		found = false;
+		shapePixels = 0;
+	}
+};
+
+/*
+	ENROLLRESULT - What happened to an item added to the catalog
+*/
+class EnrollResult
+{
+public:
+	int index;			// position of the new item in the catalog, -1 if the frame has no object
+	bool saved;			// the item was written to the catalog file, or there is no file
+	std::string error;	// why the item was not added or not saved, empty if it was
+
+	EnrollResult()
+	{
+		index = -1;
+		saved = false;
+	}
+};
+
+/*
+	OPENRESULT - What happened when a catalog file was opened
+*/
+class OpenResult
+{
+public:
+	bool opened;		// the catalog is in use, with the items before any damage
+	int items;			// number of items read from the file
+	std::string error;	// why the file was not used or not read to the end, empty if it was
+
+	OpenResult()
+	{
+		opened = false;
+		items = 0;
+	}
+};
+
+/*
+	IDENTIFIERSETTINGS - Settings an Identifier is made with
+*/
+class IdentifierSettings
+{
+public:
+	int threads;		// threads for the pipeline stages, 0 for one per core
+	int candidates;		// compares only this many items of the most similar shape, 0 for all
+	int matchCount;		// matches kept in each result
+	int pyramidScale;	// find the object on a frame this many times smaller (4 or 8), any other value filters the whole frame
+	int medianRadius;	// the median window is 2 * medianRadius + 1 pixels square, 1 keeps the fused pass
+	bool legacyEdges;	// trace and thin edges with the original straight line walks instead of hysteresis
+	double outlineTolerance;	// pixels the object outline may cut corners by
+	bool showWindows;	// show the images of each stage, only for a person watching
+
+	IdentifierSettings()
+	{
+		threads = 0;
+		candidates = 32;
+		matchCount = 3;
+		pyramidScale = 1;
+		medianRadius = 1;
+		legacyEdges = false;
+		outlineTolerance = 1.0;
+		showWindows = false;
+	}
+};
+
+class IdentifierStream;
+
+/*
+	IDENTIFIER - Identifies objects in frames and adds new ones to a catalog
+	   Never prompts, and only opens windows when showWindows is set. Any
+	   number of threads can call identify at once; enroll waits until the
+	   calls matching against the catalog are done.
+*/
+class Identifier
+{
+public:
+	Identifier(const IdentifierSettings &settings = IdentifierSettings());
+	~Identifier();
+
+	// Maps a catalog file, or makes an empty one when create is set and there is none.
+	// Without a file new items are kept until the Identifier is destroyed.
+	OpenResult open(const std::string &catalogPath, bool create = true);
+
+	// Finds the object in a BGR frame and the catalog items it matches
+	IdentifyResult identify(const cv::Mat &frame);
+
+	// Identifies frame(0) to frame(count - 1), several at a time. Each frame
+	// is made on the thread that identifies it, so decoding runs in parallel too.
+	std::vector<IdentifyResult> identifyAll(int count, const std::function<cv::Mat(int)> &frame);
+
+	// Adds the object in a BGR frame to the catalog under a name of up to 63 characters
+	EnrollResult enroll(const cv::Mat &frame, const std::string &name);
+
+	// Number of items in the catalog
+	int size();
+
+	// Number of threads the pipeline stages run on
+	int threads() const;
+
+	// Writes stage latencies and counters as JSON
+	void writeStats(std::ostream &out);
+
+	// Makes a stream that identifies against this catalog on threads stage
+	// threads of its own, counting the one that calls it
+	std::unique_ptr<IdentifierStream> openStream(int threads);
+
+private:
+	friend class IdentifierStream;
+	class Impl;
+	std::unique_ptr<Impl> impl;
+};
+
+/*
+	IDENTIFIERSTREAM - Identifies the frames of one camera against the catalog of an Identifier
+	   Has its own frame buffers and stage threads, so streams never share a
+	   workspace and only wait on each other while an item is enrolled. One
+	   thread at a time may use a stream, and it has to be destroyed before
+	   the Identifier it was opened from.
+*/
+class IdentifierStream
+{
+public:
+	~IdentifierStream();
+
+	// Finds the object in a BGR frame and the catalog items it matches
+	IdentifyResult identify(const cv::Mat &frame);
+
+	// Number of threads the pipeline stages of this stream run on
+	int threads() const;
+
+private:
+	friend class Identifier;
+	class Impl;
+	IdentifierStream(Impl *pImpl);
+	std::unique_ptr<Impl> impl;
+};
+
+/*
+	MOTIONDETECTOR - Tells when a new scene has come in front of the camera and settled
+	   Every frame is shrunk to the mean blue, green and red of each block of
+	   blockSize x blockSize pixels, read from every fourth row and column,
+	   and compared with the frame before. A block changed when one of its
+	   means moved by more than blockThreshold, and the frame moved when more than
+	   minChanged of its blocks did. After settleFrames frames without moving
+	   the scene is compared with the one that settled last time, so an object
+	   that was only jostled is not identified again.
+*/
+class MotionDetector
+{
+public:
+	int blockSize;		// a multiple of 4
+	int blockThreshold;
+	double minChanged;
+	int settleFrames;
+
+	MotionDetector();
+
+	// Takes the next frame. Returns true on the frame where a scene that
+	// differs from the last settled one has been still for settleFrames frames.
+	// Returns false for frames that are not BGR or smaller than a block, and
+	// for every frame while blockSize is not a multiple of 4.
+	bool update(const cv::Mat &frame);
+
+private:
+	void blockMeans(const cv::Mat &frame, std::vector<unsigned char> &means);
+	bool changed(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b);
+
+	std::vector<unsigned char> current;
+	std::vector<unsigned char> previous;
+	std::vector<unsigned char> settledScene;
+	int stillFrames;
+};
+
+// Times each stage on synthetic frames and prints the results, 0 threads for one per core
+int runBenchmark(int repeats, int threads);
+
+#endif
@@ -0,0 +1,698 @@
+/**
+* main.cpp
+* Console and camera frontend of the object identifier
+*/
+
+#include "identifier.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/stat.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+	CAPTURERING - Keeps a camera open and reads it on its own thread
+	   Frames go into a ring of buffers allocated from the first frame. When
+	   the ring is full the oldest unread frame is overwritten and counted as
+	   dropped. latest takes the newest frame and skips the rest, next takes
+	   every frame in order.
+*/
+class CaptureRing
+{
+public:
+	CaptureRing(int device, int capacity = 4)
+	{
+		stream.open(device);
+		start(capacity);
+	}
+
+	CaptureRing(const string &file, int capacity = 4)
+	{
+		stream.open(file);
+		start(capacity);
+	}
+
+	~CaptureRing()
+	{
+		running = false;
+		if (reader.joinable())
+			reader.join();
+		stream.release();
+	}
+
+	bool isOpened() const
+	{
+		return opened;
+	}
+
+	// Copies the newest frame that was not taken yet into frame, waiting for
+	// one if needed. Returns false once the stream has ended.
+	bool latest(Mat &frame)
+	{
+		unique_lock<mutex> lock(ringMutex);
+		while (readCount == writeCount && !ended)
+			frameReady.wait(lock);
+		if (readCount == writeCount)
+			return false;
+		readCount = writeCount;
+		slots[(readCount - 1) % slots.size()].copyTo(frame);
+		return true;
+	}
+
+	// Copies the oldest frame that was not taken yet into frame, waiting for
+	// one if needed. Returns false once the stream has ended and is drained.
+	bool next(Mat &frame)
+	{
+		unique_lock<mutex> lock(ringMutex);
+		while (readCount == writeCount && !ended)
+			frameReady.wait(lock);
+		if (readCount == writeCount)
+			return false;
+		slots[readCount % slots.size()].copyTo(frame);
+		readCount++;
+		return true;
+	}
+
+	// Number of frames waiting to be taken
+	int depth()
+	{
+		lock_guard<mutex> lock(ringMutex);
+		return (int)(writeCount - readCount);
+	}
+
+	// Number of frames that were overwritten before they were taken
+	unsigned long long dropped()
+	{
+		lock_guard<mutex> lock(ringMutex);
+		return droppedCount;
+	}
+
+private:
+	void start(int capacity)
+	{
+		writeCount = 0;
+		readCount = 0;
+		droppedCount = 0;
+		running = true;
+		ended = true;
+		opened = stream.isOpened();
+		slots.resize(max(capacity, 1));
+
+		// the first frame sets the size of every buffer in the ring
+		if (!opened || !stream.read(spare) || spare.empty())
+			return;
+		for (size_t i = 0; i < slots.size(); i++)
+			slots[i].create(spare.size(), spare.type());
+		ended = false;
+		publish();
+		reader = thread(&CaptureRing::readLoop, this);
+	}
+
+	void readLoop()
+	{
+		while (running)
+		{
+			// decode outside the lock so takers are never held up by the camera
+			if (!stream.read(spare) || spare.empty())
+				break;
+			publish();
+		}
+		lock_guard<mutex> lock(ringMutex);
+		ended = true;
+		frameReady.notify_all();
+	}
+
+	// Swaps the spare buffer with the next slot, so no frame is ever copied
+	// or allocated on the capture side
+	void publish()
+	{
+		lock_guard<mutex> lock(ringMutex);
+		if (writeCount - readCount == slots.size())
+		{
+			readCount++;
+			droppedCount++;
+		}
+		swap(slots[writeCount % slots.size()], spare);
+		writeCount++;
+		frameReady.notify_all();
+	}
+
+	VideoCapture stream;
+	vector<Mat> slots;
+	Mat spare;
+	unsigned long long writeCount;
+	unsigned long long readCount;
+	unsigned long long droppedCount;
+	bool opened;
+	bool ended;
+	atomic<bool> running;
+	mutex ringMutex;
+	condition_variable frameReady;
+	thread reader;
+};
+
+Mat getPicture(CaptureRing &camera)
+{
+	if (!camera.isOpened()) { //check if video device has been initialised
+		cout << "cannot open camera";
+	}
+	Mat cameraFrame = Mat(Size(480, 640), CV_8UC3);
+	Mat displayImage = Mat(Size(480, 640), CV_8UC3);
+	//show the newest frame until escape is pressed
+	while (camera.latest(cameraFrame))
+	{
+		cameraFrame.copyTo(displayImage);
+		rectangle(displayImage, Point(20, 20), Point(620, 460), Scalar(0, 255, 0),3);
+		circle(displayImage, Point(320, 240),3,Scalar(0,255,0),3);
+		
+		imshow("Camera", displayImage);
+		moveWindow("Camera", 0, 0);
+		if (waitKey(1) == 27)
+			break;
+	}
+	destroyAllWindows();
+	return cameraFrame;
+}
+
+// Asks whether to add the object in the frame to the catalog and what to call it
+void addItem(const Mat &frame, Identifier &identifier)
+{
+	char answer;
+	string name;
+
+	cout << "Would you like to add this item? (y/n)";
+	
+	cin >> answer;
+	cin.ignore();
+
+	while(answer != 'y' && answer != 'n')
+	{
+		cin.clear();
+		cin >> answer;
+	    cin.ignore();
+	}
+
+	if (answer == 'y')
+	{
+		cout << "What is the name of the Item? (No spaces) ";
+		cin >> name;
+		cin.ignore();
+		EnrollResult added = identifier.enroll(frame, name);
+		if (added.saved)
+			cout << name << " was added." << endl;
+		else
+			cout << " " << added.error << endl;
+	}
+	else if (answer == 'n')
+		return;
+}
+
+// Says what the object in the frame is, or offers to add it when nothing matches
+void compareItems(const Mat &frame, Identifier &identifier)
+{
+	IdentifyResult result = identifier.identify(frame);
+
+	if (!result.error.empty())
+	{
+		cout << " " << result.error << endl;
+		return;
+	}
+	if (result.shapePixels == 0)
+	{
+		cout << " Nothing to identify" << endl;
+		return;
+	}
+	if (result.found)
+	{
+		cout << " This item is " << result.name << endl;
+		for (size_t i = 1; i < result.matches.size(); i++)
+			cout << "  or " << result.matches[i].name << " (" << result.matches[i].shapeDistance << " pixels apart)" << endl;
+		return;			
+	}
+	addItem(frame, identifier);
+}
+
+// What an unattended mode reports for one identified frame
+string describeResult(const IdentifyResult &result)
+{
+	if (!result.error.empty())
+		return " " + result.error;
+	if (result.shapePixels == 0)
+		return " Nothing to identify";
+	return " This item is " + (result.found ? result.name : string("unknown"));
+}
+
+/*
+	RUNCONTINUOUS - Watches the camera and identifies each object as it settles
+	   Inputs - the open camera, the identifier and the frames an object has
+	   to stay still for
+	   Only the frames where a new scene has settled are identified; while
+	   the scene stays the same the last answer still holds. Items not in
+	   the catalog are reported as unknown without a prompt, so the camera
+	   is never held up. Escape in the camera window stops watching.
+	   Return - 0 when stopped, 1 if the camera could not be opened
+*/
+int runContinuous(CaptureRing &camera, Identifier &identifier, int settleFrames)
+{
+	if (!camera.isOpened())
+	{
+		cerr << "cannot open camera" << endl;
+		return 1;
+	}
+
+	MotionDetector motion;
+	motion.settleFrames = max(settleFrames, 1);
+	Mat frame;
+	unsigned long long frames = 0;
+	unsigned long long identified = 0;
+	while (camera.latest(frame))
+	{
+		frames++;
+		imshow("Camera", frame);
+		if (waitKey(1) == 27)
+			break;
+		if (!motion.update(frame))
+			continue;
+
+		// nobody is at the console to name new items, so they are only reported
+		identified++;
+		cout << describeResult(identifier.identify(frame)) << endl;
+	}
+	destroyAllWindows();
+
+	cout << identified << " of " << frames << " frames identified" << endl;
+	return 0;
+}
+
+/*
+	CAMERASTREAM - One camera of a multi-camera run and what it has seen
+*/
+class CameraStream
+{
+public:
+	string source;
+	unique_ptr<CaptureRing> camera;
+	unique_ptr<IdentifierStream> pipeline;
+	MotionDetector motion;
+	unsigned long long frames;
+	unsigned long long identified;
+
+	CameraStream(const string &pSource, int settleFrames)
+	{
+		source = pSource;
+		// a source made only of digits is a device number, anything else a video file
+		bool device = !source.empty() && source.find_first_not_of("0123456789") == string::npos;
+		if (device)
+			camera.reset(new CaptureRing(atoi(source.c_str())));
+		else
+			camera.reset(new CaptureRing(source));
+		motion.settleFrames = max(settleFrames, 1);
+		frames = 0;
+		identified = 0;
+	}
+};
+
+/*
+	RUNCAMERAS - Watches several cameras at once and identifies each object as it settles
+	   Inputs - device numbers or video files separated by commas, the
+	   identifier, the frames an object has to stay still for and the
+	   number of cores to share between the cameras
+	   Every camera gets its own pipeline buffers and an equal share of the
+	   cores, so a busy lane never slows the others down. A share holds the
+	   capture thread of the camera and its stage threads, one of which
+	   watches the frames, so the cameras use as many threads as there are
+	   cores as long as there are at least two per camera. All of them match
+	   against the one catalog of the identifier. Typing q stops watching.
+	   Return - 0 when stopped, 1 if a camera could not be opened
+*/
+int runCameras(const string &sources, Identifier &identifier, int settleFrames, int cores)
+{
+	vector<unique_ptr<CameraStream> > streams;
+	size_t start = 0;
+	while (start <= sources.size())
+	{
+		size_t end = min(sources.find(',', start), sources.size());
+		if (end > start)
+			streams.push_back(unique_ptr<CameraStream>(new CameraStream(sources.substr(start, end - start), settleFrames)));
+		start = end + 1;
+	}
+	if (streams.empty())
+	{
+		cerr << "usage: identifier --cameras <device|video>,<device|video>... [--catalog <file>] [--continuous <n>] [--threads <n>]" << endl;
+		return 1;
+	}
+
+	int count = (int)streams.size();
+	for (int i = 0; i < count; i++)
+	{
+		if (!streams[i]->camera->isOpened())
+		{
+			cerr << "cannot open camera " << streams[i]->source << endl;
+			return 1;
+		}
+		// the first cores % count cameras get the cores left over, and the
+		// capture ring already runs a thread of the share
+		int share = cores / count + (i < cores % count ? 1 : 0);
+		streams[i]->pipeline = identifier.openStream(max(share - 1, 1));
+	}
+
+	// shared with the keyboard reader, which may outlive this call
+	shared_ptr<atomic<bool> > stopping = make_shared<atomic<bool> >(false);
+	mutex printMutex;
+	vector<thread> watchers;
+	for (int i = 0; i < count; i++)
+	{
+		watchers.push_back(thread([&, i]
+		{
+			CameraStream &stream = *streams[i];
+			Mat frame;
+			while (!*stopping && stream.camera->latest(frame))
+			{
+				stream.frames++;
+				if (!stream.motion.update(frame))
+					continue;
+
+				stream.identified++;
+				IdentifyResult result = stream.pipeline->identify(frame);
+
+				lock_guard<mutex> lock(printMutex);
+				cout << "[" << stream.source << "]" << describeResult(result) << endl;
+			}
+		}));
+	}
+
+	// the cameras run until q is typed or they all end, so closed input
+	// leaves them running; the reader is left behind if they end first
+	thread keyboard([stopping]
+	{
+		string line;
+		while (getline(cin, line))
+			if (line == "q")
+			{
+				*stopping = true;
+				break;
+			}
+	});
+	keyboard.detach();
+
+	for (int i = 0; i < count; i++)
+		watchers[i].join();
+
+	for (int i = 0; i < count; i++)
+	{
+		CameraStream &stream = *streams[i];
+		cout << stream.source << ": " << stream.identified << " of " << stream.frames << " frames identified, "
+			<< stream.camera->dropped() << " dropped, " << stream.pipeline->threads() + 1 << " threads" << endl;
+	}
+	return 0;
+}
+
+bool isImageFile(const string &path)
+{
+	const char *extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff" };
+	string lower = path;
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = tolower(lower[i]);
+
+	for (int i = 0; i < 6; i++)
+	{
+		string ext = extensions[i];
+		if (lower.size() > ext.size() && lower.compare(lower.size() - ext.size(), ext.size(), ext) == 0)
+			return true;
+	}
+	return false;
+}
+
+// The answer written for one input of a batch
+string batchAnswer(const IdentifyResult &result)
+{
+	if (!result.error.empty())
+		return "error";
+	return result.found ? result.name : "unknown";
+}
+
+/*
+	RUNBATCH - Identifies every image in a directory or every frame of a video
+	   Inputs - Directory or video path, the identifier and the results file
+	   ("" for the console)
+	   Writes one "input,item" line per image or frame, in input order.
+	   Several inputs are identified at the same time.
+	   Return - 0 on success, 1 if the input could not be read
+*/
+int runBatch(const string &input, Identifier &identifier, const string &outputPath)
+{
+	ofstream outputFile;
+	if (!outputPath.empty())
+	{
+		outputFile.open(outputPath.c_str());
+		if (!outputFile)
+		{
+			cerr << "cannot write " << outputPath << endl;
+			return 1;
+		}
+	}
+	ostream &results = outputPath.empty() ? cout : outputFile;
+
+	int chunkSize = identifier.threads() * 4;
+	vector<Mat> frames(chunkSize);
+	int processed = 0;
+	double start = (double)getTickCount();
+
+	struct stat info;
+	bool isDirectory = stat(input.c_str(), &info) == 0 && (info.st_mode & S_IFDIR);
+
+	if (isDirectory)
+	{
+		vector<String> files;
+		vector<string> images;
+		glob(input, files, false);
+		for (size_t i = 0; i < files.size(); i++)
+			if (isImageFile(files[i]))
+				images.push_back(files[i]);
+
+		for (size_t first = 0; first < images.size(); first += chunkSize)
+		{
+			int count = (int)min((size_t)chunkSize, images.size() - first);
+			// images are decoded on the workers too
+			vector<IdentifyResult> found = identifier.identifyAll(count, [&](int i)
+			{
+				return imread(images[first + i]);
+			});
+			for (int i = 0; i < count; i++)
+				results << images[first + i] << "," << batchAnswer(found[i]) << endl;
+			processed += count;
+		}
+	}
+	else
+	{
+		VideoCapture video(input);
+		if (!video.isOpened())
+		{
+			cerr << "cannot open " << input << endl;
+			return 1;
+		}
+
+		bool more = true;
+		while (more)
+		{
+			// the decoder is sequential, so read a chunk and process it in parallel
+			int count = 0;
+			while (count < chunkSize)
+			{
+				frames[count] = Mat();
+				if (!video.read(frames[count]))
+				{
+					more = false;
+					break;
+				}
+				count++;
+			}
+
+			vector<IdentifyResult> found = identifier.identifyAll(count, [&](int i)
+			{
+				return frames[i];
+			});
+			for (int i = 0; i < count; i++)
+				results << input << "#" << processed + i << "," << batchAnswer(found[i]) << endl;
+			processed += count;
+		}
+	}
+
+	double seconds = ((double)getTickCount() - start) / getTickFrequency();
+	cerr << processed << " inputs in " << seconds << " s (" << processed / max(seconds, 1e-9) << " per second)" << endl;
+	return 0;
+}
+
+/** @function main */
+int main(int argc, char** argv)
+{
+	IdentifierSettings settings;
+	settings.threads = thread::hardware_concurrency();
+	string batchInput;
+	string catalogPath;
+	string outputPath;
+	string statsPath;
+	int benchmarkRuns = 0;
+	int settleFrames = 0;
+	string cameraSources;
+
+	// --threads N sets how many cores are used
+	// --catalog FILE maps known items at start and adds new ones to the end of it
+	// --candidates N compares only the N items of the most similar shape, 0 for all
+	// --batch DIR|VIDEO identifies every image or frame without any prompts
+	// --output FILE writes the batch results to a file instead of the console
+	// --benchmark N times each stage N times on synthetic frames
+	// --stats FILE writes stage latencies and counters as JSON on exit
+	// --pyramid N finds the object on a frame N (4 or 8) times smaller and filters only around it
+	// --median-radius N blurs with a median window of 2N+1 pixels square instead of 3x3
+	// --edges walk|hysteresis traces and thins edges with the original straight line walks or with hysteresis
+	// --continuous N watches the camera and identifies every object that stays still for N frames
+	// --cameras A,B,... watches several devices or video files at once and shares the cores between them
+	for (int i = 1; i < argc - 1; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--threads")
+			settings.threads = atoi(argv[++i]);
+		else if (arg == "--catalog")
+			catalogPath = argv[++i];
+		else if (arg == "--candidates")
+			settings.candidates = atoi(argv[++i]);
+		else if (arg == "--batch")
+			batchInput = argv[++i];
+		else if (arg == "--output")
+			outputPath = argv[++i];
+		else if (arg == "--benchmark")
+			benchmarkRuns = atoi(argv[++i]);
+		else if (arg == "--stats")
+			statsPath = argv[++i];
+		else if (arg == "--pyramid")
+		{
+			settings.pyramidScale = atoi(argv[++i]);
+			if (settings.pyramidScale != 1 && settings.pyramidScale != 4 && settings.pyramidScale != 8)
+			{
+				cerr << "--pyramid takes 1, 4 or 8, not " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (arg == "--median-radius")
+		{
+			settings.medianRadius = atoi(argv[++i]);
+			if (settings.medianRadius < 1)
+			{
+				cerr << "--median-radius takes 1 or more, not " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (arg == "--edges")
+		{
+			string edges = argv[++i];
+			if (edges != "walk" && edges != "hysteresis")
+			{
+				cerr << "--edges takes walk or hysteresis, not " << edges << endl;
+				return 1;
+			}
+			settings.legacyEdges = edges == "walk";
+		}
+		else if (arg == "--continuous")
+			settleFrames = atoi(argv[++i]);
+		else if (arg == "--cameras")
+			cameraSources = argv[++i];
+	}
+
+	// only the interactive mode has someone watching the stage windows
+	settings.threads = max(settings.threads, 1);
+	settings.showWindows = batchInput.empty() && settleFrames <= 0 && cameraSources.empty();
+	// with several cameras every stream brings its own share of the threads
+	int cores = settings.threads;
+	if (!cameraSources.empty())
+		settings.threads = 1;
+	Identifier identifier(settings);
+
+	// a catalog that cannot be read only stops a batch, the other modes start empty
+	OpenResult catalog;
+	catalog.opened = true;
+	if (benchmarkRuns <= 0 && !catalogPath.empty())
+	{
+		catalog = identifier.open(catalogPath, batchInput.empty());
+		if (!catalog.error.empty())
+			cerr << catalog.error << endl;
+	}
+
+	int status = 0;
+	if (benchmarkRuns > 0)
+		status = runBenchmark(benchmarkRuns, cores);
+	else if (!catalog.opened && !batchInput.empty())
+		status = 1;
+	else if (!batchInput.empty())
+	{
+		if (catalogPath.empty())
+		{
+			cerr << "usage: identifier --batch <directory|video> --catalog <file> [--output <file>] [--threads <n>] [--stats <file>] [--pyramid <n>] [--median-radius <n>]" << endl;
+			status = 1;
+		}
+		else
+			status = runBatch(batchInput, identifier, outputPath);
+	}
+	else if (!cameraSources.empty())
+		status = runCameras(cameraSources, identifier, settleFrames > 0 ? settleFrames : MotionDetector().settleFrames, cores);
+	else if (settleFrames > 0)
+	{
+		CaptureRing camera(2);
+		status = runContinuous(camera, identifier, settleFrames);
+	}
+	else
+	{
+		// the camera stays open between pictures
+		CaptureRing camera(2);   //0 is the id of video device.0 if you have only one camera.
+		char input = 'c';
+
+		while (input != 'q')
+		{
+			if (input == 's')
+			{
+				// print the stats so far without taking a picture
+				identifier.writeStats(cout);
+				cout << "camera queue " << camera.depth() << " frames, " << camera.dropped() << " dropped" << endl;
+			}
+			else
+			{
+				Mat img = Mat(Size(480, 640), CV_8UC3);
+				if (input == 'c')
+				{
+					img = getPicture(camera);
+				}
+				compareItems(img, identifier);
+			}
+			
+			cout << "If you wish to take another picture press (c). For timings press (s). If you wish to quit press (q) ";
+			cin >> input;
+			cin.ignore();
+
+		}
+	}
+
+	if (!statsPath.empty())
+	{
+		ofstream statsFile(statsPath.c_str());
+		identifier.writeStats(statsFile);
+		if (!statsFile)
+		{
+			cerr << "cannot write stats " << statsPath << endl;
+			status = 1;
+		}
+	}
+	 
+	return status;
+}